@@ -0,0 +1,149 @@
+/**
+ * The TinyLFU admission filter (-o admission=tinylfu). Without it, every
+ * block that is read from the disk enters the cache and evicts the
+ * policy's victim, so one long scan over a cold file flushes the hot
+ * blocks out. With it, a new block only replaces the victim if it was
+ * accessed more often than the victim lately, as estimated by a compact
+ * count-min sketch of the accesses to every block, cached or not.
+ * The sketch keeps 4 bit counters, about 4 per cached block, and halves
+ * them all whenever it counted 10 accesses per cached block, so blocks
+ * that were popular long ago fade away.
+ */
+#ifndef _ADMISSION_H
+#define _ADMISSION_H
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include "Block.h"
+
+#define ADMISSION_NONE "none"
+#define ADMISSION_TINYLFU "tinylfu"
+#define SKETCH_DEPTH 4			// Counters per key
+#define SKETCH_COUNTERS_PER_BLOCK 4	// Of the cache's capacity
+#define SKETCH_MIN_COUNTERS 64
+#define SKETCH_SAMPLE_FACTOR 10		// Accesses per block between agings
+#define SKETCH_COUNTER_BITS 4
+#define SKETCH_COUNTER_MAX 15
+#define SKETCH_COUNTERS_PER_WORD 16
+#define SKETCH_HALVE_MASK 0x7777777777777777ULL
+
+static bool admissionFilter = false;	// Set by -o admission=tinylfu
+
+/**
+ * Returns true if the given name is an admission filter's name.
+ */
+bool isAdmissionName(const std::string &name)
+{
+	return name == ADMISSION_NONE || name == ADMISSION_TINYLFU;
+}
+
+/**
+ * A count-min sketch of block accesses with 4 bit counters. A key's
+ * counters are picked by double hashing, an access increments only the
+ * smallest of them (which keeps the estimates tighter), and the estimate
+ * is the smallest counter.
+ */
+class FrequencySketch
+{
+public:
+	std::vector<uint64_t> table;	// 16 counters per word
+	size_t mask;		// The number of counters - 1
+	size_t additions;	// Accesses counted since the last aging
+	size_t sampleSize;	// ... which ages the counters when reached
+
+	/**
+	 * Constructs a sketch for a cache of the given number of blocks.
+	 */
+	FrequencySketch(size_t capacity) : additions(0)
+	{
+		size_t counters = SKETCH_MIN_COUNTERS;
+		while (counters < capacity * SKETCH_COUNTERS_PER_BLOCK)
+		{
+			counters *= 2;
+		}
+		table.assign(counters / SKETCH_COUNTERS_PER_WORD, 0);
+		mask = counters - 1;
+		sampleSize = std::max((size_t) 1,
+				      capacity * SKETCH_SAMPLE_FACTOR);
+	}
+
+	/**
+	 * Returns the hash the counters of the given key are picked by.
+	 */
+	static uint64_t hash(const BlockKey &key)
+	{
+		uint64_t hash = BlockKeyHash()(key) * 0x9E3779B97F4A7C15ULL;
+		return hash ^ (hash >> 31);
+	}
+
+	/**
+	 * Returns the index of the i'th counter of the key with the hash.
+	 */
+	size_t counterIndex(uint64_t hash, int i) const
+	{
+		return (hash + i * ((hash >> 32) | 1)) & mask;
+	}
+
+	unsigned int counter(size_t index) const
+	{
+		return (table[index / SKETCH_COUNTERS_PER_WORD] >>
+			(index % SKETCH_COUNTERS_PER_WORD *
+			 SKETCH_COUNTER_BITS)) & SKETCH_COUNTER_MAX;
+	}
+
+	/**
+	 * Returns the estimated number of recent accesses to the key.
+	 */
+	unsigned int estimate(const BlockKey &key) const
+	{
+		uint64_t keyHash = hash(key);
+		unsigned int least = SKETCH_COUNTER_MAX;
+		for (int i = 0; i < SKETCH_DEPTH; ++i)
+		{
+			least = std::min(least,
+					 counter(counterIndex(keyHash, i)));
+		}
+		return least;
+	}
+
+	/**
+	 * Count an access to the key.
+	 */
+	void increment(const BlockKey &key)
+	{
+		uint64_t keyHash = hash(key);
+		unsigned int least = estimate(key);
+		for (int i = 0; least < SKETCH_COUNTER_MAX && i < SKETCH_DEPTH;
+		     ++i)
+		{
+			// Two of the key's counters may be the same one
+			size_t index = counterIndex(keyHash, i);
+			if (counter(index) == least)
+			{
+				table[index / SKETCH_COUNTERS_PER_WORD] +=
+					1ULL << (index %
+					SKETCH_COUNTERS_PER_WORD *
+					SKETCH_COUNTER_BITS);
+			}
+		}
+		if (++additions >= sampleSize)
+		{
+			age();
+		}
+	}
+
+	/**
+	 * Halve all the counters.
+	 */
+	void age()
+	{
+		for (uint64_t &word : table)
+		{
+			word = (word >> 1) & SKETCH_HALVE_MASK;
+		}
+		additions /= 2;
+	}
+};
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <cstdlib>
+#include <sys/mman.h>
+#include "my_pthread.h"
+#include "Stats.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * Hands out the data buffers of the blocks from one contiguous region,
+ * mapped once at mount time, so a miss or an eviction never calls the
+ * allocator and the cache's memory use is known up front.
+ * Buffers are carved from the region in order the first time they're
+ * needed (so its pages are only touched when the cache fills up), and
+ * released buffers are kept in a free list that is threaded through the
+ * buffers themselves. If the region is used up, or was never mapped (e.g.
+ * in the tools), buffers come from the heap instead.
+ */
+class BlockArena
+{
+public:
+	pthread_mutex_t lock;	// Guards all the members below
+	char *region;		// nullptr if not mapped
+	size_t regionSize;	// In bytes, rounded up to the page size
+	size_t bufferSize;
+	size_t buffers;		// The number of buffers in the region
+	size_t carved;		// The number of buffers carved so far
+	char *freeList;		// Released buffers, each pointing to the next
+	bool hugePages;		// Whether the region is on huge pages
+
+	BlockArena() : region(nullptr), regionSize(0), bufferSize(0),
+		buffers(0), carved(0), freeList(nullptr), hugePages(false)
+	{
+		my_pthread_mutex_init(&lock, nullptr);
+	}
+
+	~BlockArena()
+	{
+		destroy();
+		my_pthread_mutex_destroy(&lock);
+	}
+
+	/**
+	 * Map a region for count buffers of the given size (a multiple of the
+	 * page size, or a power of two smaller than it, so every buffer stays
+	 * aligned to its size or to a page). If huge is true, huge pages are
+	 * tried first, then transparent huge pages. Returns false if the
+	 * region can't be mapped at all.
+	 */
+	bool init(size_t count, size_t size, bool huge)
+	{
+		ScopedLock guard(&lock);
+		bufferSize = size;
+		buffers = count;
+		carved = 0;
+		freeList = nullptr;
+		hugePages = false;
+		regionSize = count * size;
+		if (huge)
+		{
+			size_t hugeSize = (regionSize + HUGE_PAGE_SIZE - 1) /
+				HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+			region = (char*) mmap(nullptr, hugeSize,
+					PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+					-1, 0);
+			if (region != MAP_FAILED)
+			{
+				regionSize = hugeSize;
+				hugePages = true;
+				return true;
+			}
+		}
+		region = (char*) mmap(nullptr, regionSize, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (region == MAP_FAILED)
+		{
+			region = nullptr;
+			return false;
+		}
+		if (huge)
+		{
+			// Only a hint, so failing is fine
+			madvise(region, regionSize, MADV_HUGEPAGE);
+		}
+		return true;
+	}
+
+	/**
+	 * Returns true if the buffer belongs to the region.
+	 */
+	bool owns(const char *buffer) const
+	{
+		return region != nullptr && buffer >= region &&
+			buffer < region + buffers * bufferSize;
+	}
+
+	/**
+	 * Returns a buffer of the given size, from the region if possible.
+	 * Returns nullptr if the heap is out of memory.
+	 */
+	char *allocate(size_t size)
+	{
+		{
+			ScopedLock guard(&lock);
+			if (region != nullptr && size == bufferSize)
+			{
+				char *buffer = freeList;
+				if (buffer != nullptr)
+				{
+					freeList = *(char**) buffer;
+					return buffer;
+				}
+				if (carved < buffers)
+				{
+					return region + bufferSize * carved++;
+				}
+			}
+		}
+		if (region != nullptr)
+		{
+			countStat(STAT_ARENA_OVERFLOWS);
+		}
+		return (char*) aligned_alloc(size, size);
+	}
+
+	/**
+	 * Give a buffer that allocate() returned back.
+	 */
+	void release(char *buffer)
+	{
+		{
+			ScopedLock guard(&lock);
+			if (owns(buffer))
+			{
+				*(char**) buffer = freeList;
+				freeList = buffer;
+				return;
+			}
+		}
+		free(buffer);
+	}
+
+	/**
+	 * Unmap the region. All its buffers must have been released.
+	 */
+	void destroy()
+	{
+		ScopedLock guard(&lock);
+		if (region != nullptr)
+		{
+			munmap(region, regionSize);
+			region = nullptr;
+		}
+		freeList = nullptr;
+		buffers = carved = 0;
+	}
+};
+
+static BlockArena blockArena;	// The data buffers of all the blocks
+
+#endif
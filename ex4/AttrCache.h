@@ -0,0 +1,191 @@
+/**
+ * The attribute cache: getattr() answers from it for up to attr_timeout
+ * seconds instead of calling lstat() every time. Paths are mapped to the
+ * files' (st_dev, st_ino), and the attributes are kept per inode, so all
+ * the links of a file share them, and a file's attributes can be dropped
+ * after it's written, truncated or renamed without knowing its paths.
+ */
+#ifndef _ATTRCACHE_H
+#define _ATTRCACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <sys/stat.h>
+#include "Block.h"
+#include "Expiring.h"
+#include "Trace.h"
+#include "Stats.h"
+#include "my_pthread.h"
+
+using std::string;
+
+#define DEF_ATTR_TIMEOUT 1.0	// Seconds, the same as fuse's default
+#define ATTR_CACHE_MAX 65536	// Files (and paths) beyond that evict the oldest
+
+class AttrCache
+{
+public:
+	pthread_mutex_t lock;	// Guards paths and attrs
+	ExpiringMap<string, FileId> paths;	// Relative to mountdir
+	ExpiringMap<FileId, struct stat, FileIdHash> attrs;
+	uint64_t ttlNsec;	// 0 turns the cache off
+	std::atomic<uint64_t> generation;	// Changes when attrs are dropped
+
+	AttrCache() : paths(ATTR_CACHE_MAX), attrs(ATTR_CACHE_MAX),
+		ttlNsec(DEF_ATTR_TIMEOUT * NSEC_PER_SEC), generation(0)
+	{
+		my_pthread_mutex_init(&lock, nullptr);
+	}
+
+	~AttrCache()
+	{
+		my_pthread_mutex_destroy(&lock);
+	}
+
+	/**
+	 * Set how long attributes are cached, in seconds.
+	 */
+	void configure(double timeoutSec)
+	{
+		ttlNsec = timeoutSec * NSEC_PER_SEC;
+	}
+
+	/**
+	 * Returns when attributes taken now expire, or 0 if they aren't
+	 * cached at all.
+	 */
+	uint64_t expiry() const
+	{
+		return ttlNsec == 0 ? 0 : monotonicNsec() + ttlNsec;
+	}
+
+	/**
+	 * Set st to the cached attributes of the file at path. Returns false
+	 * if they aren't cached or expired.
+	 */
+	bool get(const string &path, struct stat &st)
+	{
+		if (ttlNsec == 0)
+		{
+			return false;
+		}
+		ScopedLock guard(&lock);
+		FileId *file = paths.find(path, monotonicNsec());
+		if (file == nullptr || !find(*file, st))
+		{
+			countStat(STAT_ATTR_MISSES);
+			return false;
+		}
+		countStat(STAT_ATTR_HITS);
+		return true;
+	}
+
+	/**
+	 * Set st to the cached attributes of the given file. Returns false
+	 * if they aren't cached or expired.
+	 */
+	bool get(const FileId &file, struct stat &st)
+	{
+		if (ttlNsec == 0)
+		{
+			return false;
+		}
+		ScopedLock guard(&lock);
+		bool found = find(file, st);
+		countStat(found ? STAT_ATTR_HITS : STAT_ATTR_MISSES);
+		return found;
+	}
+
+	/**
+	 * Cache the attributes of the file at path (or of an open file, if
+	 * path is empty).
+	 */
+	void put(const string &path, const struct stat &st)
+	{
+		if (ttlNsec == 0)
+		{
+			return;
+		}
+		FileId file{st.st_dev, st.st_ino};
+		uint64_t now = monotonicNsec();
+		ScopedLock guard(&lock);
+		if (!path.empty())
+		{
+			paths.put(path, file, now + ttlNsec, now);
+		}
+		attrs.put(file, st, now + ttlNsec, now);
+	}
+
+	/**
+	 * Drop the cached attributes of the given file, after it changed.
+	 */
+	void invalidate(const FileId &file)
+	{
+		generation.fetch_add(1);
+		if (ttlNsec == 0)
+		{
+			return;
+		}
+		ScopedLock guard(&lock);
+		attrs.erase(file);
+	}
+
+	/**
+	 * Forget the file at path, and the files under it if it's a
+	 * directory, after it was created, renamed or replaced. The
+	 * directory it's in changes too, so its attributes are dropped.
+	 */
+	void forget(const string &path)
+	{
+		generation.fetch_add(1);
+		if (ttlNsec == 0)
+		{
+			return;
+		}
+		size_t slash = path.rfind('/');
+		string parent = slash == 0 || slash == string::npos ? "/" :
+			path.substr(0, slash);
+		ScopedLock guard(&lock);
+		ExpiringMap<string, FileId>::Map::iterator it =
+			paths.entries.find(parent);
+		if (it != paths.entries.end())
+		{
+			attrs.erase(it->second.value);
+		}
+		for (it = paths.entries.begin(); it != paths.entries.end(); )
+		{
+			const string &other = it->first;
+			if (other.compare(0, path.size(), path) == 0 &&
+			    (other.size() == path.size() ||
+			     other[path.size()] == '/'))
+			{
+				attrs.erase(it->second.value);
+				it = paths.entries.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+
+	/**
+	 * Set st to the file's attributes if they are cached and fresh. Must
+	 * be called with lock held.
+	 */
+	bool find(const FileId &file, struct stat &st)
+	{
+		struct stat *cached = attrs.find(file, monotonicNsec());
+		if (cached == nullptr)
+		{
+			return false;
+		}
+		st = *cached;
+		return true;
+	}
+};
+
+static AttrCache attrCache;	// The attributes of the files getattr saw
+
+#endif
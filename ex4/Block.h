@@ -0,0 +1,317 @@
+#ifndef _BLOCK_H
+#define _BLOCK_H
+
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <unordered_map>
+#include <cstdint>
+#include <sys/types.h>
+#include "Arena.h"
+
+using std::string;
+
+#define DEF_REF_COUNT 1
+
+class Block;
+
+/**
+ * Identifies a file by its device and inode numbers, which are taken when
+ * the file is opened and don't change when it (or a directory above it) is
+ * renamed.
+ */
+struct FileId
+{
+	dev_t dev;
+	ino_t ino;
+
+	bool operator== (const FileId& other) const
+	{
+		return ino == other.ino && dev == other.dev;
+	}
+
+	bool operator!= (const FileId& other) const
+	{
+		return !(*this == other);
+	}
+};
+
+struct FileIdHash
+{
+	size_t operator() (const FileId& id) const
+	{
+		return (uint64_t) id.ino * 0x9E3779B97F4A7C15ULL ^ id.dev;
+	}
+};
+
+/**
+ * The key of a block in the cache index: its file and its number in it.
+ * Comparing keys is two integer compares (three with the device).
+ */
+struct BlockKey
+{
+	FileId file;
+	size_t number;
+
+	bool operator== (const BlockKey& other) const
+	{
+		return number == other.number && file == other.file;
+	}
+};
+
+struct BlockKeyHash
+{
+	size_t operator() (const BlockKey& key) const
+	{
+		uint64_t hash = FileIdHash()(key.file) ^ 
+			key.number * 0xC2B2AE3D27D4EB4FULL;
+		return hash ^ (hash >> 29);
+	}
+};
+
+/**
+ * The links of a block in one intrusive list. prev points towards the MRU
+ * end of the list and next towards the LRU end.
+ */
+struct BlockLinks
+{
+	Block *prev, *next;
+};
+
+/**
+ * A data block of a file. See comments on data members for details.
+ */
+class Block
+{
+public:
+	static size_t size;	// The cache's block size (-o block_size=)
+
+	FileId file;		// The file this block belongs to
+	size_t number;		// The number of block in the file
+	size_t refCount;	// Reference count
+	char *data;		// The actual (aligned) data of the block, or
+				// nullptr while it's compressed
+	char *packed;		// The compressed data, if it is (Compress.h)
+	size_t packedSize;
+	size_t written;		// The valid bytes (fewer at the end of file)
+	bool prefetched;	// Read ahead, and not referenced yet
+	bool dirty;		// Written, and not written back yet
+
+	// Bookkeeping of the cache policy (see Policy.h)
+	BlockLinks links;	// Links in its policy's main list
+	BlockLinks bucket;	// Links in a secondary list of its policy
+	int queue;		// Which of its policy's lists the block is in
+	void *policyEntry;	// Policy specific data of the block, if any
+	
+	/**
+	 * Constructs a new Block object.
+	 * This blocks belongs to the file 'fileId', and is the 'num' block
+	 * for this file (starting from 0).
+	 * Default refCount is 1, no data is written.
+	 * Throws std::bad_alloc if there's no memory for its data.
+	 */
+	Block(const FileId &fileId, size_t num) : file(fileId), 
+					number(num), refCount(DEF_REF_COUNT),
+					packed(nullptr), packedSize(0),
+					written(0), prefetched(false),
+					dirty(false),
+					links{nullptr, nullptr},
+					bucket{nullptr, nullptr},
+					queue(0), policyEntry(nullptr)
+	{
+		// Take an aligned buffer from the arena
+		data = blockArena.allocate(Block::size);
+		if (data == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+	}
+
+	/**
+	 * Blocks are owned by the cache, which only relinks them, so the
+	 * data buffer never moves or gets copied while the block is cached.
+	 */
+	Block(const Block &other) = delete;
+	Block& operator= (const Block &other) = delete;
+
+	/**
+	 * Free allocated data.
+	 */
+	~Block()
+	{
+		if (data != nullptr)
+		{
+			blockArena.release(data);
+			data = nullptr;
+		}
+		free(packed);
+	}
+
+	/**
+	 * Returns the bytes of memory the block's data takes.
+	 */
+	size_t memory() const
+	{
+		return packed != nullptr ? packedSize : Block::size;
+	}
+	
+	/**
+	 * Returns the key of the block in the cache index.
+	 */
+	BlockKey key() const
+	{
+		return BlockKey{file, number};
+	}
+
+	/**
+	 * Not actually needed.
+	 */
+	bool isEqualTo(const Block& other)
+	{
+		return file == other.file && number == other.number &&
+			written == other.written;
+	}
+
+	/**
+	 * Checks if this block is the one with the given file and number
+	 */
+	bool isEqualTo(const FileId& otherFile, size_t otherNum)
+	{
+		return number == otherNum && file == otherFile;
+	}
+};
+
+size_t Block::size = 0;
+
+/**
+ * An intrusive doubly linked list of blocks, ordered from the MRU block
+ * (head) to the LRU block (tail). The list doesn't own its blocks, and uses
+ * the links given on construction, so a block can be in several lists.
+ */
+class BlockList
+{
+public:
+	Block *head, *tail;
+	size_t count;
+	BlockLinks Block::*links;
+
+	BlockList(BlockLinks Block::*blockLinks = &Block::links) : 
+		head(nullptr), tail(nullptr), count(0), links(blockLinks)
+	{
+	}
+
+	/**
+	 * Return the next block towards the LRU end of the list.
+	 */
+	Block *next(Block *block) const
+	{
+		return (block->*links).next;
+	}
+
+	/**
+	 * Return the previous block towards the MRU end of the list.
+	 */
+	Block *prev(Block *block) const
+	{
+		return (block->*links).prev;
+	}
+
+	/**
+	 * Link the given block as the new head (MRU) of the list.
+	 */
+	void pushFront(Block *block)
+	{
+		(block->*links).prev = nullptr;
+		(block->*links).next = head;
+		if (head != nullptr)
+		{
+			(head->*links).prev = block;
+		}
+		else
+		{
+			tail = block;
+		}
+		head = block;
+		++count;
+	}
+
+	/**
+	 * Link the given block as the new tail (LRU) of the list.
+	 */
+	void pushBack(Block *block)
+	{
+		(block->*links).next = nullptr;
+		(block->*links).prev = tail;
+		if (tail != nullptr)
+		{
+			(tail->*links).next = block;
+		}
+		else
+		{
+			head = block;
+		}
+		tail = block;
+		++count;
+	}
+
+	/**
+	 * Unlink the given block, which must be in this list.
+	 */
+	void remove(Block *block)
+	{
+		BlockLinks &l = block->*links;
+		if (l.prev != nullptr)
+		{
+			(l.prev->*links).next = l.next;
+		}
+		else
+		{
+			head = l.next;
+		}
+		if (l.next != nullptr)
+		{
+			(l.next->*links).prev = l.prev;
+		}
+		else
+		{
+			tail = l.prev;
+		}
+		l.prev = l.next = nullptr;
+		--count;
+	}
+
+	/**
+	 * Unlink and return the tail (LRU) block, or nullptr if empty.
+	 */
+	Block *popBack()
+	{
+		Block *block = tail;
+		if (block != nullptr)
+		{
+			remove(block);
+		}
+		return block;
+	}
+};
+
+typedef std::unordered_map<BlockKey, Block*, BlockKeyHash> BlocksIndex;
+
+/**
+ * Returns a new block, like new(std::nothrow): nullptr if there's no
+ * memory for it or its data, so the fuse operations can fail with ENOMEM.
+ */
+Block *allocBlock(const FileId &fileId, size_t num)
+{
+	try
+	{
+		return new Block(fileId, num);
+	}
+	catch (const std::bad_alloc &)
+	{
+		return nullptr;
+	}
+}
+
+#endif
@@ -3,29 +3,42 @@
 
 #include <string>
 #include <vector>
+#include <unordered_map>
+#include <functional>
+#include <map>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <fuse.h>
 #include <ctime>
+#include "my_pthread.h"
+#include "Block.h"
+#include "Policy.h"
+#include "Admission.h"
+#include "Compress.h"
+#include "Stats.h"
+#include "OpLog.h"
 
 using std::string;
 using std::vector;
 
-#define DEF_REF_COUNT 1
-#define NOT_IN_CACHE -1
-#define IN_CACHE 0
 #define LOG_FILE ".filesystem.log"
-#define DELIM " "
+#define DELIM LOG_DELIM
 #define CACHING_STATE ((CachingState*) fuse_get_context()->private_data)
+#define CACHE_SHARDS 16		// Maximal number of cache shards
+#define MIN_SHARD_BLOCKS 64	// Smaller caches get fewer shards
 
 /**
  * The private_data object for fuse. Holds the log stream and rootdir.
+ * The log stream is written by opLog's thread and by the ioctl dump, so it
+ * must only be written while holding logLock.
  */
 class CachingState
 {
 public:
 	string rootdir;
 	std::ofstream logfile;
+	pthread_mutex_t logLock;
 
 	/**
 	 * initialize the rootdir to the given one, open the logfile in append
@@ -35,220 +48,589 @@ public:
 		rootdir(root), logfile(root + "/" LOG_FILE, 
 				std::ofstream::out | std::ofstream::app)
 	{
+		my_pthread_mutex_init(&logLock, nullptr);
+	}
+
+	~CachingState()
+	{
+		my_pthread_mutex_destroy(&logLock);
 	}
 };
 
 /**
  * Write a line to the log that contains the time and the function name
+ * (a string literal). The line is written in the background, see OpLog.h.
  */
-void writeToLog(const string &func)
+void writeToLog(const char *func)
 {
-	CACHING_STATE->logfile << time(nullptr) << DELIM << func << std::endl;
+	opLog.push(func);
 }
 
+static size_t newIdx, oldIdx, maxSize;	// Parameters for the caching
+					// algorithm.
+static string policyName = DEF_POLICY;	// The cache replacement policy
+
 /**
- * A data block of a file. See comments on data members for details.
+ * Called with every dirty block the cache evicts, instead of freeing it:
+ * the callee takes the block over, and frees it once it's written back.
+ * If nullptr, dirty blocks are freed like the rest.
  */
-class Block
+static void (*evictDirtyBlock)(Block *block) = nullptr;
+
+/**
+ * Called with every clean block the cache evicts, instead of freeing it:
+ * the callee takes the block over (e.g. to keep it in a slower tier). If
+ * nullptr, clean blocks are just freed.
+ */
+static void (*evictCleanBlock)(Block *block) = nullptr;
+
+/**
+ * Called with every block that cooled down and may be compressed (see
+ * CacheShard::settle), so it can be compressed later without the shard
+ * lock. If nullptr, such blocks are compressed right away.
+ */
+static void (*packCooledBlock)(const Block *block) = nullptr;
+
+/**
+ * One independent cache, holding a share of the blocks. The cache is split
+ * to shards by block key, so threads working on different blocks rarely
+ * wait for each other. The shard owns its blocks and their index, and its
+ * policy decides which of them to evict.
+ * The shard's capacity is in bytes of block data: with -o compress, the
+ * blocks leaving FBR's new section are compressed, so more of them fit,
+ * and the policy's victims are evicted until the blocks fit again.
+ * The methods don't lock anything: the caller must hold the shard's lock
+ * for as long as it uses the shard or any of its blocks.
+ */
+class CacheShard
 {
 public:
-	static size_t size;	// Block size in the filesystem
+	pthread_mutex_t lock;
+	BlocksIndex index;		// (file, number) -> cached block
+	CachePolicy *policy;		// Orders the blocks for eviction
+	FrequencySketch *sketch;	// The admission filter's, if it's on
+	size_t newIdx, oldIdx, maxSize;	// This shard's share of the cache
+	size_t bytes, maxBytes;		// The memory its blocks' data takes,
+					// and the most it may take
+	size_t packedBlocks;		// The compressed ones
+
+	CacheShard() : policy(nullptr), sketch(nullptr), newIdx(0), oldIdx(0),
+		maxSize(0), bytes(0), maxBytes(0), packedBlocks(0)
+	{
+		my_pthread_mutex_init(&lock, nullptr);
+	}
+
+	~CacheShard()
+	{
+		clear();
+		delete sketch;
+		delete policy;
+		my_pthread_mutex_destroy(&lock);
+	}
+
+	CacheShard(const CacheShard &other) = delete;
+	CacheShard& operator= (const CacheShard &other) = delete;
 
-	std::string filename;	// The file this block belongs to
-	size_t number;		// The number of block in the file
-	size_t refCount;	// Reference count
-	char *data;		// The actual (aligned) data of the block
-	size_t written;		// Amount of bytes actually written
-	
 	/**
-	 * For move ctor... "Steal" data from other block.
-	 */ 
-	friend void swap(Block& lhs, Block& rhs)
+	 * Returns the number of blocks currently in the shard.
+	 */
+	size_t size() const
 	{
-		using std::swap;
-		swap(lhs.filename, rhs.filename);
-		swap(lhs.number, rhs.number);
-		swap(lhs.refCount, rhs.refCount);
-		swap(lhs.written, rhs.written);		
-		char *tmp = lhs.data;
-		lhs.data = rhs.data;
-		rhs.data = tmp;
+		return index.size();
 	}
-	
+
 	/**
-	 * Constructs a new Block object.
-	 * This blocks belongs to filename 'file', and is the 'num' block
-	 * for this file (starting from 0).
-	 * Default refCount is 1, no data is written.
+	 * Free a block the policy evicted (it already unlinked it).
 	 */
-	Block(std::string file, int num) : filename(file), number(num),
-					refCount(DEF_REF_COUNT), written(0)
+	void evict(Block *victim)
 	{
-		// Allocate aligned block
-		data = (char*) aligned_alloc(Block::size, Block::size);
-		if (data == nullptr)
+		countStat(STAT_EVICTIONS);
+		if (victim->prefetched)
 		{
-			// Handle alloc error
+			countStat(STAT_PREFETCH_UNUSED);
+		}
+		index.erase(victim->key());
+		forget(victim);
+		if (victim->dirty && evictDirtyBlock != nullptr)
+		{
+			evictDirtyBlock(victim);
+		}
+		else if (evictCleanBlock != nullptr)
+		{
+			evictCleanBlock(victim);
+		}
+		else
+		{
+			delete victim;
 		}
 	}
 
 	/**
-	 * (Deep-)Copy ctor, copy data to a new allocated memory
+	 * Stop counting the memory of a block that leaves the shard.
 	 */
-	Block(const Block &other) : Block(other.filename, other.number)
+	void forget(const Block *block)
 	{
-		refCount = other.refCount;
-	       	written = other.written;
-		memcpy(data, other.data, Block::size);
+		bytes -= block->memory();
+		if (block->packed != nullptr)
+		{
+			--packedBlocks;
+		}
 	}
 
 	/**
-	 * Move ctor, make sure the moved block's data isn't deleted.
+	 * Returns true if the block may be compressed: it's clean, out of the
+	 * policy's hot part, not compressed yet, and not a read ahead block
+	 * that wasn't read yet (which is about to be).
 	 */
-	Block(Block&& other)
+	bool packable(const Block *block) const
 	{
-		swap(*this, other);
-		other.data = nullptr;
+		return block->queue != NEW_SECTION && !block->dirty &&
+			!block->prefetched && block->packed == nullptr;
 	}
 
 	/**
-	 * Note that the other block is delivered by value, so it's OK to
-	 * steal its data.
-	 * The idea here is that the argument that's copied by value is
-	 * actually moved there, and not deep copied.
+	 * Keep the block compressed, in packed (see setPacked).
 	 */
-	Block& operator= (Block other)
+	void pack(Block *block, char *packed, size_t packedSize)
 	{
-		swap(*this, other);
-		return *this;
+		setPacked(block, packed, packedSize);
+		bytes -= Block::size - packedSize;
+		++packedBlocks;
 	}
 
 	/**
-	 * Free allocated data.
+	 * Compress (or hand to packCooledBlock) the blocks the policy moved
+	 * out of its hot part during the last operation, and then evict the
+	 * policy's victims (but never keep) while the blocks take more than
+	 * maxBytes.
 	 */
-	~Block()
+	void settle(const Block *keep)
 	{
-		if (data != nullptr)
+		for (Block *block : policy->cooled)
 		{
-			free(data);
-			data = nullptr;
+			if (!packable(block))
+			{
+				continue;
+			}
+			if (packCooledBlock != nullptr)
+			{
+				packCooledBlock(block);
+				continue;
+			}
+			size_t packedSize;
+			char *packed = packData(block->data, block->written,
+						packedSize);
+			if (packed != nullptr)
+			{
+				pack(block, packed, packedSize);
+			}
+		}
+		policy->cooled.clear();
+		Block *victim;
+		while (bytes > maxBytes &&
+		       (victim = policy->victim()) != nullptr && victim != keep)
+		{
+			policy->remove(victim);
+			evict(victim);
 		}
 	}
-	
+
 	/**
-	 * Not actually needed.
+	 * Decompress the block, if it's compressed. Returns false if it
+	 * can't be, in which case the block stays compressed.
 	 */
-	bool isEqualTo(const Block& other)
+	bool unpack(Block *block)
 	{
-		return  (filename.compare(other.filename) == 0) &&
-			(number == other.number &&
-			 written == other.written);
+		if (block->packed == nullptr)
+		{
+			return true;
+		}
+		size_t packedSize = block->packedSize;
+		if (!unpackBlock(block))
+		{
+			return false;
+		}
+		bytes += Block::size - packedSize;
+		--packedBlocks;
+		return true;
 	}
 
 	/**
-	 * Checks if this block is the one with the given filename and number
+	 * Let the policy place a block that is new to it, and free the block
+	 * it evicted for that, if any.
 	 */
-	bool isEqualTo(const string& otherFile, size_t otherNum)
+	void place(Block *block)
 	{
-		// Check whether the filename and block number match and
-		// if this is a fully written block.
-		return (filename.compare(otherFile) == 0) &&
-			number == otherNum;
+		Block *victim = policy->insert(block);
+		if (victim != nullptr)
+		{
+			evict(victim);
+		}
+		settle(block);
 	}
-};
 
-size_t Block::size = 0;
+	/**
+	 * Unlink the given block from the shard without freeing it.
+	 */
+	void detach(Block *block)
+	{
+		policy->remove(block);
+		index.erase(block->key());
+		forget(block);
+	}
 
-typedef std::vector<Block> BlocksCache;
-static BlocksCache cache;		// The data structure for caching
-static size_t newIdx, oldIdx, maxSize;	// Parameters for the caching
-					// algorithm.
+	/**
+	 * Remove the given block from the shard and free it.
+	 */
+	void remove(Block *block)
+	{
+		detach(block);
+		delete block;
+	}
+
+	/**
+	 * Add a block to the shard, which takes ownership of it. If the 
+	 * shard is full, the policy evicts another block first. Returns the
+	 * added block.
+	 */
+	Block *add(Block *block)
+	{
+		index[block->key()] = block;
+		bytes += block->memory();
+		place(block);
+		return block;
+	}
+
+	/**
+	 * Add a block that was read from the disk like add(), unless the
+	 * admission filter is on, the shard is full, and the block wasn't
+	 * accessed more often lately than the block the policy would evict
+	 * for it. referenced tells if the block is added for a read (and not
+	 * read ahead), which counts as an access to it.
+	 * Returns the added block, or nullptr if it was rejected, in which
+	 * case the caller still owns it.
+	 */
+	Block *admit(Block *block, bool referenced = true)
+	{
+		if (sketch == nullptr)
+		{
+			return add(block);
+		}
+		BlockKey key = block->key();
+		if (referenced)
+		{
+			sketch->increment(key);
+		}
+		Block *victim = index.size() >= policy->capacity ||
+			bytes + Block::size > maxBytes ? policy->victim() :
+			nullptr;
+		if (victim != nullptr &&
+		    sketch->estimate(key) <= sketch->estimate(victim->key()))
+		{
+			countStat(STAT_ADMISSION_REJECTS);
+			return nullptr;
+		}
+		return add(block);
+	}
+
+	/**
+	 * Search for a block in the shard, and tell the policy it was 
+	 * referenced. The first real reference of a prefetched block is like
+	 * the miss that would have cached it, so the policy sees it as a new
+	 * block instead. A compressed block is decompressed, and if that
+	 * fails, it's removed (it's clean, so the disk has its data) and
+	 * treated as a miss.
+	 * Return the block upon success and nullptr if it isn't cached.
+	 */
+	Block *get(const FileId& file, size_t num)
+	{
+		BlocksIndex::iterator it = index.find(BlockKey{file, num});
+		if (it == index.end())
+		{
+			return nullptr;
+		}
+		Block *block = it->second;
+		if (sketch != nullptr)
+		{
+			sketch->increment(it->first);
+		}
+		if (block->prefetched)
+		{
+			countStat(STAT_PREFETCH_USED);
+			block->prefetched = false;
+			policy->remove(block);
+			place(block);
+		}
+		else
+		{
+			policy->hit(block);
+		}
+		if (!unpack(block))
+		{
+			remove(block);
+			block = nullptr;
+		}
+		settle(block);
+		return block;
+	}
+
+	/**
+	 * Returns the block if it's in the shard and nullptr otherwise,
+	 * without touching its recency or refCount. The block may be
+	 * compressed (see unpack).
+	 */
+	Block *peek(const FileId& file, size_t num) const
+	{
+		BlocksIndex::const_iterator it = index.find(BlockKey{file, num});
+		return it == index.end() ? nullptr : it->second;
+	}
+
+	/**
+	 * Returns true if the block is in the shard, without touching its 
+	 * recency or refCount.
+	 */
+	bool contains(const FileId& file, size_t num) const
+	{
+		return index.count(BlockKey{file, num}) != 0;
+	}
+
+	/**
+	 * Call func on every block in the shard, in the policy's order (for
+	 * FBR, from the LRU block to the MRU one).
+	 */
+	template <typename Func>
+	void forEach(Func func)
+	{
+		policy->forEach(func);
+	}
+
+	/**
+	 * Remove and free every block in the shard.
+	 */
+	void clear()
+	{
+		if (policy != nullptr)
+		{
+			policy->clear();
+			policy->cooled.clear();
+		}
+		for (BlocksIndex::value_type &entry : index)
+		{
+			delete entry.second;
+		}
+		index.clear();
+		bytes = packedBlocks = 0;
+	}
+};
+
+static CacheShard *shards = nullptr;	// The cache, split to shards
+static size_t numShards = 0;
 
 /**
- * Choose the block that has the least refcount in the old partition, and
- * remove it from the cache.
- * Note that we start looking for blocks to evict from the LRU to MRU,
- * thus if two blocks are identicals in terms of refCount, the LRU one will
- * be evicted.
+ * Split the cache to shards according to maxSize, newIdx and oldIdx. Every
+ * shard gets an equal share of the blocks and the same section fractions,
+ * and its own instance of the policy named policyName.
+ * Caches too small to split keep a single shard, which behaves exactly
+ * like one cache.
  */
-void evictBlock()
+void initCache()
 {
-	// No need to evict if the cache isn't full.
-	if (cache.size() < maxSize)
-		return;
-
-	size_t lfuBlockIndex = 0, lfuBlockRef = cache[0].refCount;
-	// j is the real index in the vector.
-	// i is the logical index.
-	int j = maxSize;
-	// Find the block with the minimal refCount in the old partition
-	for (size_t i = maxSize - 1; i >= oldIdx; --i)
+	delete[] shards;
+	numShards = std::max((size_t) 1, 
+			std::min((size_t) CACHE_SHARDS, 
+				 maxSize / MIN_SHARD_BLOCKS));
+	shards = new CacheShard[numShards];
+	for (size_t i = 0; i < numShards; ++i)
 	{
-		j = maxSize - i - 1;
-		if (cache[j].refCount < lfuBlockRef)
+		CacheShard &shard = shards[i];
+		shard.maxSize = maxSize / numShards + 
+			(i < maxSize % numShards ? 1 : 0);
+		shard.oldIdx = std::min(oldIdx * shard.maxSize / maxSize,
+				shard.maxSize - 1);
+		shard.newIdx = std::max((size_t) 1, std::min(
+				newIdx * shard.maxSize / maxSize, 
+				shard.oldIdx));
+		shard.maxBytes = shard.maxSize * Block::size;
+		shard.policy = createPolicy(policyName, compressBlocks ?
+				shard.maxSize * PACKED_MAX_SHARE :
+				shard.maxSize, shard.newIdx, shard.oldIdx,
+				shard.maxSize);
+		shard.policy->reportCooled = compressBlocks;
+		if (admissionFilter)
 		{
-			lfuBlockIndex = j;
-			lfuBlockRef = cache[j].refCount;
+			shard.sketch = new FrequencySketch(shard.maxSize);
 		}
 	}
-	// Delete it.
-	cache.erase(cache.begin() + lfuBlockIndex);
 }
 
 /**
- * Add a block to the cache.
+ * Returns the shard the given block belongs to.
+ */
+CacheShard &shardOf(const FileId &file, size_t num)
+{
+	size_t hash = BlockKeyHash()(BlockKey{file, num});
+	return shards[(hash ^ (hash >> 17)) % numShards];
+}
+
+/**
+ * Returns the number of blocks currently in the cache.
+ */
+size_t cacheSize()
+{
+	size_t size = 0;
+	for (size_t i = 0; i < numShards; ++i)
+	{
+		ScopedLock lock(&shards[i].lock);
+		size += shards[i].size();
+	}
+	return size;
+}
+
+/**
+ * Sum up the memory of the cache: the number of blocks and of compressed
+ * ones, the bytes their data takes, and the most it may take.
+ */
+void cacheMemory(size_t &blocks, size_t &packed, size_t &bytes,
+		 size_t &maxBytes)
+{
+	blocks = packed = bytes = maxBytes = 0;
+	for (size_t i = 0; i < numShards; ++i)
+	{
+		ScopedLock lock(&shards[i].lock);
+		blocks += shards[i].size();
+		packed += shards[i].packedBlocks;
+		bytes += shards[i].bytes;
+		maxBytes += shards[i].maxBytes;
+	}
+}
+
+/**
+ * Call func on every cached block, shard after shard, from the LRU block 
+ * to the MRU one of each shard. Every shard is locked while it's visited.
  */
-void addToCache(Block block)
+template <typename Func>
+void forEachBlock(Func func)
 {
-	if (cache.size() == maxSize)
+	for (size_t i = 0; i < numShards; ++i)
 	{
-		evictBlock();
+		ScopedLock lock(&shards[i].lock);
+		shards[i].forEach(func);
 	}
-	
-	cache.push_back(block);
 }
 
 /**
- * Search for a block in the cache. If found, move it to the end of the 
- * vector (top of the stack) and update its refCount.
- * Return 0 upon success and -1 if the block isn't in the cache.
+ * Remove and free every cached block.
  */
-int getBlock(const std::string& fileName, size_t num)
+void clearCache()
 {
-	size_t j = 0;	// logical index of the item in the vector
-	for (int i = cache.size() - 1; i >= 0; --i)
+	for (size_t i = 0; i < numShards; ++i)
 	{
-		j = cache.size() - i - 1;
-		if (cache[i].isEqualTo(fileName, num))
+		ScopedLock lock(&shards[i].lock);
+		shards[i].clear();
+	}
+}
+
+/**
+ * Free the cache and its shards.
+ */
+void destroyCache()
+{
+	delete[] shards;
+	shards = nullptr;
+	numShards = 0;
+}
+
+/**
+ * Remove and free every cached block of the given file. This visits every
+ * block, so it's only for rare events, like the file being replaced.
+ */
+void removeFileFromCache(const FileId &file)
+{
+	for (size_t i = 0; i < numShards; ++i)
+	{
+		ScopedLock lock(&shards[i].lock);
+		vector<Block*> blocks;
+		shards[i].forEach([&](Block &block)
 		{
-			if (j >= newIdx)
+			if (block.file == file)
 			{
-				++cache[i].refCount;
+				blocks.push_back(&block);
 			}
-			cache.push_back(cache[i]);
-			cache.erase(cache.begin() + i);
-			return IN_CACHE;
+		});
+		for (Block *block : blocks)
+		{
+			shards[i].remove(block);
 		}
 	}
-	return NOT_IN_CACHE;
 }
 
 /**
- * Check the filename of each block. If it matches the oldName argument,
- * replace it with newName.
+ * Make the cached blocks of a file match its new size, after it changed
+ * from oldSize: the blocks past its new end are removed, and the block the
+ * nearer end is in is cut or zero filled up to the new end, since a block
+ * that isn't full marks the end of the file.
  */
-void renameInCache(const string &oldName, const string &newName)
+void resizeFileInCache(const FileId &file, size_t oldSize, size_t newSize)
 {
-	size_t found = 0;
-	for (size_t i = 0; i < cache.size(); ++i)
+	size_t firstGone = (newSize + Block::size - 1) / Block::size,
+	       oldBlocks = (oldSize + Block::size - 1) / Block::size;
+	if (oldBlocks > firstGone + maxSize)
 	{
-		if ((found = cache[i].filename.find(oldName)) != string::npos)
+		// Cheaper to look at every cached block
+		for (size_t i = 0; i < numShards; ++i)
 		{
-			cache[i].filename.replace(found, oldName.size(), 
-					newName);
+			ScopedLock lock(&shards[i].lock);
+			vector<Block*> blocks;
+			shards[i].forEach([&](Block &block)
+			{
+				if (block.file == file &&
+				    block.number >= firstGone)
+				{
+					blocks.push_back(&block);
+				}
+			});
+			for (Block *block : blocks)
+			{
+				shards[i].remove(block);
+			}
+		}
+	}
+	else
+	{
+		for (size_t num = firstGone; num < oldBlocks; ++num)
+		{
+			CacheShard &shard = shardOf(file, num);
+			ScopedLock lock(&shard.lock);
+			Block *block = shard.peek(file, num);
+			if (block != nullptr)
+			{
+				shard.remove(block);
+			}
 		}
 	}
-}
 
+	size_t edge = std::min(oldSize, newSize) / Block::size;
+	CacheShard &shard = shardOf(file, edge);
+	ScopedLock lock(&shard.lock);
+	Block *block = shard.peek(file, edge);
+	if (block != nullptr && !shard.unpack(block))
+	{
+		// Clean, so the disk has its data
+		shard.remove(block);
+		block = nullptr;
+	}
+	if (block != nullptr)
+	{
+		shard.settle(block);
+		size_t valid = std::min(Block::size,
+					newSize - edge * Block::size);
+		if (valid > block->written)
+		{
+			memset(block->data + block->written, 0,
+			       valid - block->written);
+		}
+		block->written = valid;
+	}
+}
 
 #endif
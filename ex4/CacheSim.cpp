@@ -0,0 +1,274 @@
+/**
+ * Replays a trace recorded by CachingFileSystem (-o trace=file) against the
+ * cache in Cache.h, at many cache sizes, policies and FBR partitions, and
+ * prints the hit ratio of every combination: one row per cache size and one
+ * column per policy (and fOld/fNew, for FBR and adaptive FBR, where they
+ * are the starting point), ready for plotting.
+ *
+ * Usage: CacheSim tracefile [-p policy,...] [-b blocks,...]
+ *			     [-f fOld:fNew,...] [-a]
+ *
+ * By default every policy is simulated, FBR with a few partitions, at
+ * cache sizes from 16 blocks up to the trace's footprint in powers of two.
+ * Readahead isn't simulated, the trace only holds the blocks that were
+ * asked for. -a puts the TinyLFU admission filter in front of every cache.
+ */
+#define FUSE_USE_VERSION 26
+
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+#include <unordered_set>
+#include <sstream>
+
+#include "Cache.h"
+#include "Trace.h"
+
+#define USAGE_MSG "Usage: CacheSim tracefile [-p policy,...] " \
+	"[-b blocks,...] [-f fOld:fNew,...] [-a]"
+#define EXIT_SUCC 0
+#define EXIT_FAIL 1
+#define SIM_BLOCK_SIZE 64	// The data is never used, so keep it small
+#define SIM_MIN_BLOCKS 16
+#define FILE_ID_SHIFT 40	// Packs (file id, block) into one footprint key
+
+/**
+ * One simulated cache configuration.
+ */
+struct SimConfig
+{
+	string policy;
+	double fOld, fNew;	// Only used by FBR
+	string label;		// The column title
+};
+
+static vector<string> names;	// File id -> file name
+static vector<TraceRecord> reads;
+
+/**
+ * Print the usage message and exit.
+ */
+void sim_usage()
+{
+	std::cerr << USAGE_MSG << std::endl;
+	exit(EXIT_FAIL);
+}
+
+/**
+ * Split the given comma separated list.
+ */
+vector<string> splitList(const string &list)
+{
+	vector<string> items;
+	std::istringstream stream(list);
+	string item;
+	while (std::getline(stream, item, ','))
+	{
+		items.push_back(item);
+	}
+	return items;
+}
+
+/**
+ * Replay the trace against a cache of the given size and configuration.
+ * Returns the hit ratio, or a negative number if the FBR partitions are
+ * invalid for this size (the same checks the filesystem makes).
+ */
+double simulate(const SimConfig &config, size_t blocks)
+{
+	maxSize = blocks;
+	newIdx = maxSize * config.fNew;
+	oldIdx = maxSize * (1 - config.fOld);
+	if ((config.policy == POLICY_FBR ||
+	     config.policy == POLICY_ADAPTIVE_FBR) &&
+	    (newIdx <= 0 || oldIdx >= maxSize))
+	{
+		return -1;
+	}
+	policyName = config.policy;
+	initCache();
+
+	size_t hits = 0, total = 0;
+	for (const TraceRecord &read : reads)
+	{
+		// Trace ids are unique per file, like inodes
+		FileId file{0, read.fileId};
+		for (size_t num = read.first; num < read.first + read.count;
+		     ++num)
+		{
+			CacheShard &shard = shardOf(file, num);
+			ScopedLock lock(&shard.lock);
+			if (shard.get(file, num) != nullptr)
+			{
+				++hits;
+			}
+			else
+			{
+				Block *block = new Block(file, num);
+				if (shard.admit(block) == nullptr)
+				{
+					delete block;
+				}
+			}
+			++total;
+		}
+	}
+	clearCache();
+	return total == 0 ? 0 : (double) hits / total;
+}
+
+int main(int argc, char *argv[])
+{
+	vector<string> policies{POLICY_FBR, POLICY_ADAPTIVE_FBR, POLICY_LRU,
+				POLICY_LFU, POLICY_2Q, POLICY_ARC,
+				POLICY_CLOCK_PRO};
+	vector<size_t> sizes;
+	vector<std::pair<double, double> > partitions{{0.2, 0.1}, {0.2, 0.3},
+		{0.2, 0.5}, {0.4, 0.1}, {0.4, 0.3}, {0.4, 0.5}, {0.6, 0.1},
+		{0.6, 0.3}};
+
+	int opt;
+	while ((opt = getopt(argc, argv, "p:b:f:a")) != -1)
+	{
+		switch (opt)
+		{
+		case 'p':
+			policies = splitList(optarg);
+			for (const string &policy : policies)
+			{
+				if (!isPolicyName(policy))
+				{
+					sim_usage();
+				}
+			}
+			break;
+		case 'b':
+			for (const string &size : splitList(optarg))
+			{
+				if (atoi(size.c_str()) <= 0)
+				{
+					sim_usage();
+				}
+				sizes.push_back(atoi(size.c_str()));
+			}
+			break;
+		case 'f':
+			partitions.clear();
+			for (const string &pair : splitList(optarg))
+			{
+				double fOld = 0, fNew = 0;
+				if (sscanf(pair.c_str(), "%lf:%lf", &fOld,
+					   &fNew) != 2 ||
+				    fOld < 0 || fNew < 0 || fOld + fNew > 1)
+				{
+					sim_usage();
+				}
+				partitions.push_back(std::make_pair(fOld, fNew));
+			}
+			break;
+		case 'a':
+			admissionFilter = true;
+			break;
+		default:
+			sim_usage();
+		}
+	}
+	if (optind != argc - 1)
+	{
+		sim_usage();
+	}
+
+	size_t traceBlockSize = 0, blockReads = 0;
+	std::unordered_set<uint64_t> footprint;
+	if (!readTrace(argv[optind], traceBlockSize,
+		       [](uint32_t id, const string &name)
+		       {
+			       names.resize(std::max(names.size(),
+						     (size_t) id + 1));
+			       names[id] = name;
+		       },
+		       [&](const TraceRecord &read)
+		       {
+			       reads.push_back(read);
+			       blockReads += read.count;
+			       for (size_t i = 0; i < read.count; ++i)
+			       {
+				       footprint.insert(((uint64_t) read.fileId
+						<< FILE_ID_SHIFT) + read.first + i);
+			       }
+		       }))
+	{
+		std::cerr << "Can't read the trace " << argv[optind] << std::endl;
+		return EXIT_FAIL;
+	}
+	for (const TraceRecord &read : reads)
+	{
+		if (read.fileId >= names.size())
+		{
+			std::cerr << "Unnamed file in the trace" << std::endl;
+			return EXIT_FAIL;
+		}
+	}
+	if (sizes.empty())
+	{
+		for (size_t blocks = SIM_MIN_BLOCKS; ; blocks *= 2)
+		{
+			sizes.push_back(blocks);
+			if (blocks >= footprint.size())
+			{
+				break;
+			}
+		}
+	}
+
+	vector<SimConfig> configs;
+	for (const string &policy : policies)
+	{
+		if (policy != POLICY_FBR && policy != POLICY_ADAPTIVE_FBR)
+		{
+			configs.push_back(SimConfig{policy, 0, 0, policy});
+			continue;
+		}
+		for (std::pair<double, double> &partition : partitions)
+		{
+			std::ostringstream label;
+			label << policy << "/" << partition.first << "/"
+			      << partition.second;
+			configs.push_back(SimConfig{policy, partition.first,
+					partition.second, label.str()});
+		}
+	}
+
+	Block::size = SIM_BLOCK_SIZE;
+	printf("# %zu reads of %zu blocks (%zu distinct) of %zu bytes, "
+	       "%zu files\n", reads.size(), blockReads, footprint.size(),
+	       traceBlockSize, names.size());
+	printf("# hit ratio by cache size (blocks); fbr/fOld/fNew%s\n",
+	       admissionFilter ? "; with " ADMISSION_TINYLFU " admission" : "");
+	printf("%10s", "blocks");
+	for (const SimConfig &config : configs)
+	{
+		printf(" %12s", config.label.c_str());
+	}
+	printf("\n");
+	for (size_t blocks : sizes)
+	{
+		printf("%10zu", blocks);
+		for (const SimConfig &config : configs)
+		{
+			double ratio = simulate(config, blocks);
+			if (ratio < 0)
+			{
+				printf(" %12s", "-");
+			}
+			else
+			{
+				printf(" %12.4f", ratio);
+			}
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+	destroyCache();
+	return EXIT_SUCC;
+}
@@ -7,10 +7,24 @@
 #include <cstring>
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/uio.h>
 
 #include "Cache.h"
+#include "WriteBack.h"
+#include "Readahead.h"
+#include "Trace.h"
+#include "Snapshot.h"
+#include "Stats.h"
+#include "AttrCache.h"
+#include "PathCache.h"
+#include "VictimCache.h"
+#include "DirCache.h"
+#include "NegativeCache.h"
+#include "InFlight.h"
+#include "Packer.h"
 #include <climits>
 #include <algorithm>
+#include <cstddef>
 // CL Arguments
 #define NUM_ARGS 6
 #define ROOT_ARG 1
@@ -20,18 +34,208 @@
 #define NEW_ARG 5
 // Some constants
 #define USAGE_MSG "Usage: CachingFileSystem rootdir mountdir " \
-	"numberOfBlocks fOld fNew"
+	"numberOfBlocks fOld fNew" \
+	" [-o cache_policy=fbr|afbr|lru|lfu|2q|arc|clockpro]" \
+	" [-o trace=tracefile] [-o hugepages] [-o snapshot=file]" \
+	" [-o dirty_expire=msec] [-o dirty_max=blocks] [-o attr_timeout=sec]" \
+	" [-o entry_timeout=sec] [-o negative_timeout=sec]" \
+	" [-o log_level=all|sampled|off]" \
+	" [-o log_sample=n] [-o admission=none|tinylfu]" \
+	" [-o victim_cache=file] [-o victim_blocks=n] [-o block_size=bytes]" \
+	" [-o compress] [fuse options]"
 #define SYSERROR_MSG(f) "System Error: \"" << f << "\" has failed."
 #define EXIT_SUCC 0
 #define EXIT_FAIL 1
 #define OPEN_FLAGS O_RDONLY | O_DIRECT | O_SYNC
+// Writers read too, to fill the blocks they only change part of. The blocks
+// are written back whole, so the disk's buffers don't have to be aligned.
+#define WRITE_OPEN_FLAGS O_RDWR
+#define ARENA_SPARE_BYTES (128 * 4096)	// For blocks being read, not cached
+#define ARENA_MIN_SPARE_BLOCKS 16	// yet
+#define MAX_BLOCK_SIZE (16 * 1024 * 1024)
+#define UNSET_TIMEOUT -1.0	// A timeout option that wasn't given
+#define COMPRESSION_LINE_MAX 256
 
 using namespace std;
 
 struct fuse_operations caching_oper;
 
+/**
+ * Our own mount options, which fuse_opt_parse takes out of the arguments
+ * before they are passed on to fuse.
+ */
+struct CachingOptions
+{
+	char *policy;	// The cache replacement policy (-o cache_policy=)
+	char *trace;	// Where to record the reads (-o trace=)
+	int hugePages;	// Put the block buffers on huge pages (-o hugepages)
+	char *snapshot;	// Where to save the cache on unmount (-o snapshot=)
+	int dirtyExpire;// How long writes may stay cached, in milliseconds
+			// (-o dirty_expire=)
+	int dirtyMax;	// The most dirty blocks (-o dirty_max=)
+	double attrTimeout;	// How long attributes are cached, in seconds
+				// (-o attr_timeout=, which fuse gets too)
+	double negativeTimeout;	// How long missing paths are cached, in
+				// seconds (-o negative_timeout=, which fuse
+				// gets too)
+	char *logLevel;	// Which operations are logged (-o log_level=)
+	unsigned int logSample;	// Log one of that many with log_level=sampled
+				// (-o log_sample=)
+	char *admission;	// The admission filter (-o admission=)
+	char *victimCache;	// The victim cache's file (-o victim_cache=)
+	int victimBlocks;	// ... and its size (-o victim_blocks=)
+	unsigned int blockSize;	// The cache's block size, in bytes, if not
+				// the rootdir's (-o block_size=)
+	int compress;	// Compress the cold blocks (-o compress)
+};
+
+static const struct fuse_opt caching_opts[] =
+{
+	{"cache_policy=%s", offsetof(CachingOptions, policy), 0},
+	{"trace=%s", offsetof(CachingOptions, trace), 0},
+	{"hugepages", offsetof(CachingOptions, hugePages), 1},
+	{"snapshot=%s", offsetof(CachingOptions, snapshot), 0},
+	{"dirty_expire=%d", offsetof(CachingOptions, dirtyExpire), 0},
+	{"dirty_max=%d", offsetof(CachingOptions, dirtyMax), 0},
+	{"attr_timeout=%lf", offsetof(CachingOptions, attrTimeout), 0},
+	FUSE_OPT_KEY("attr_timeout=", FUSE_OPT_KEY_KEEP),
+	{"negative_timeout=%lf", offsetof(CachingOptions, negativeTimeout), 0},
+	FUSE_OPT_KEY("negative_timeout=", FUSE_OPT_KEY_KEEP),
+	{"log_level=%s", offsetof(CachingOptions, logLevel), 0},
+	{"log_sample=%u", offsetof(CachingOptions, logSample), 0},
+	{"admission=%s", offsetof(CachingOptions, admission), 0},
+	{"victim_cache=%s", offsetof(CachingOptions, victimCache), 0},
+	{"victim_blocks=%d", offsetof(CachingOptions, victimBlocks), 0},
+	{"block_size=%u", offsetof(CachingOptions, blockSize), 0},
+	{"compress", offsetof(CachingOptions, compress), 1},
+	FUSE_OPT_END
+};
+
+/**
+ * The state of an open file, which fuse keeps for us in fi->fh. Reads of
+ * the same file may run concurrently, so the readahead state is guarded
+ * by lock, and so is the file's size, which is kept so reads don't have to
+ * stat the file (see caching_file_size).
+ * The stats file has no fd, its reads are served from a snapshot of the
+ * stats taken on open.
+ */
+class OpenFile
+{
+public:
+	int fd;			// -1 for the stats file
+	FileId id;		// The key of the file's blocks in the cache
+	bool writable;		// Opened for writing
+	Readahead readahead;
+	pthread_mutex_t lock;
+	off_t size;		// The file's size on the disk, when it was taken
+	uint64_t sizeGeneration;// attrCache.generation when it was taken
+	uint64_t sizeExpires;	// When it must be taken again (0 = always)
+	string stats;		// The stats file's contents
+
+	OpenFile(int fileFd, const FileId &fileId, bool canWrite = false) :
+		fd(fileFd), id(fileId), writable(canWrite), size(0),
+		sizeGeneration(0), sizeExpires(0)
+	{
+		my_pthread_mutex_init(&lock, nullptr);
+	}
+
+	~OpenFile()
+	{
+		my_pthread_mutex_destroy(&lock);
+	}
+};
+
+/**
+ * The last known path (relative to the rootdir) of every file that was
+ * opened, for the ioctl dump: the cache only knows the files' ids.
+ */
+class FileNames
+{
+public:
+	pthread_mutex_t lock;	// Guards names
+	std::unordered_map<FileId, string, FileIdHash> names;
+
+	FileNames()
+	{
+		my_pthread_mutex_init(&lock, nullptr);
+	}
+
+	~FileNames()
+	{
+		my_pthread_mutex_destroy(&lock);
+	}
+
+	void set(const FileId &id, const string &path)
+	{
+		ScopedLock guard(&lock);
+		names[id] = path;
+	}
+
+	void erase(const FileId &id)
+	{
+		ScopedLock guard(&lock);
+		names.erase(id);
+	}
+
+	/**
+	 * Set path to the path of the given file. Returns false if it's
+	 * unknown.
+	 */
+	bool find(const FileId &id, string &path)
+	{
+		ScopedLock guard(&lock);
+		std::unordered_map<FileId, string, FileIdHash>::iterator it =
+			names.find(id);
+		if (it == names.end())
+		{
+			return false;
+		}
+		path = it->second;
+		return true;
+	}
+
+	/**
+	 * Returns the path of the given file, or "?" if it's unknown.
+	 */
+	string get(const FileId &id)
+	{
+		string path;
+		return find(id, path) ? path : "?";
+	}
+
+	/**
+	 * Update the paths of the files under oldPath (or the file at it) 
+	 * after it was renamed to newPath. This visits every known file,
+	 * not every cached block.
+	 */
+	void rename(const string &oldPath, const string &newPath)
+	{
+		ScopedLock guard(&lock);
+		for (std::pair<const FileId, string> &entry : names)
+		{
+			string &path = entry.second;
+			if (path.compare(0, oldPath.size(), oldPath) == 0 &&
+			    (path.size() == oldPath.size() || 
+			     path[oldPath.size()] == '/'))
+			{
+				path.replace(0, oldPath.size(), newPath);
+			}
+		}
+	}
+};
+
+static FileNames fileNames;
+
 /* ========== Helper Functions ========== */
 
+/**
+ * Returns the open file state kept in the given fuse_file_info.
+ */
+static OpenFile *caching_open_file(struct fuse_file_info *fi)
+{
+	return (OpenFile*) (uintptr_t) fi->fh;
+}
+
 /**
  * Displays a usage message and exits. Does not return.
  */
@@ -51,17 +255,38 @@ void caching_syserror(const string &func)
 }
 
 /**
- * Returns an absolute path (to fpath) from a relative one (from path)
+ * The state of an open directory, which fuse keeps for us in fi->fh. A
+ * directory whose listing is cached isn't opened at all.
+ */
+struct OpenDir
+{
+	DIR *dirp;		// nullptr if the listing is cached
+	struct stat st;		// Taken before it was opened
+	DirListingPtr listing;	// The cached listing, if it is
+};
+
+/**
+ * Returns an absolute path (to fpath) from a relative one (from path).
+ * Paths that were resolved before come from the path cache.
  */
 static void caching_fullpath(char fpath[PATH_MAX], const char *path)
 {
+	uint64_t generation;
+	if (pathCache.get(path, fpath, generation))
+	{
+		return;
+	}
 	// Get absolute path from the given path
 	// (note that this is absolute from mountdir root)
 	char abspath[PATH_MAX];
 	string fullpath = CACHING_STATE->rootdir + "/" + path;
-	// Remove double slashes...
-	realpath(fullpath.c_str(), abspath);
-	fullpath = abspath;
+	// Remove double slashes... (a file that is about to be created
+	// doesn't exist yet, so it keeps its path, and isn't cached)
+	if (realpath(fullpath.c_str(), abspath) != nullptr)
+	{
+		fullpath = abspath;
+		pathCache.put(path, abspath, generation);
+	}
 	// Return full path as c_str
 	strcpy(fpath, fullpath.c_str());
 }
@@ -74,6 +299,242 @@ static bool caching_is_log_path(const string &path)
 	return path.find(LOG_FILE) == 0;
 }
 
+/**
+ * Returns true if the given path (relative to the mountdir) is the path to
+ * the virtual stats file, which doesn't exist in the rootdir.
+ */
+static bool caching_is_stats_path(const char *path)
+{
+	return strcmp(path, STATS_FILE) == 0;
+}
+
+/**
+ * Fill statbuf with the attributes of the stats file, with the given size.
+ */
+static void caching_stats_attr(struct stat *statbuf, size_t size)
+{
+	memset(statbuf, 0, sizeof(*statbuf));
+	statbuf->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+	statbuf->st_nlink = 1;
+	statbuf->st_uid = getuid();
+	statbuf->st_gid = getgid();
+	statbuf->st_size = size;
+	statbuf->st_atime = statbuf->st_mtime = statbuf->st_ctime = 
+		time(nullptr);
+}
+
+/**
+ * Copy the part of the given cached block that a read wants into buf, at
+ * bytesRead, and advance bytesRead. blockOff is the offset of the read in
+ * the block, and size is the size of the whole read.
+ * Returns the number of bytes the block holds, which is less than 
+ * Block::size only for the last block of the file.
+ */
+static size_t caching_copy_block(const Block *block, char *buf, size_t size,
+				 size_t &bytesRead, size_t blockOff)
+{
+	size_t written = block->written;
+	if (written > blockOff)
+	{
+		size_t toCopy = std::min(written - blockOff, size - bytesRead);
+		memcpy(buf + bytesRead, block->data + blockOff, toCopy);
+		bytesRead += toCopy;
+	}
+	return written;
+}
+
+/**
+ * Cache a block of the file that a read missed, which was read (from the
+ * disk or the victim cache) into newBlock, and copy from it like
+ * caching_copy_block. If another thread cached the block meanwhile, its
+ * copy is used instead. If the file's stamp changed since the read took
+ * stamp, or the admission filter keeps it out, newBlock only serves this
+ * read. newBlock is freed unless it's cached, or it came from the victim
+ * cache (demoted) and the admission filter kept it out, in which case it
+ * goes back there.
+ */
+static size_t caching_fill_block(const FileId &id, Block *newBlock,
+				 uint64_t stamp, char *buf, size_t size,
+				 size_t &bytesRead, size_t blockOff,
+				 bool demoted = false)
+{
+	CacheShard &shard = shardOf(id, newBlock->number);
+	my_pthread_mutex_lock(&shard.lock);
+	// Another thread may have cached it in the meantime
+	Block *block = shard.get(id, newBlock->number), *uncached = nullptr;
+	bool rejected = false;
+	if (block != nullptr)
+	{
+		delete newBlock;
+	}
+	else if (writeBack.stamp(id) != stamp)
+	{
+		// A racing write may be missing from it, so it's only good
+		// for this read
+		block = uncached = newBlock;
+	}
+	else if ((block = shard.admit(newBlock)) == nullptr)
+	{
+		// The admission filter kept it out
+		block = uncached = newBlock;
+		rejected = true;
+	}
+	size_t written = caching_copy_block(block, buf, size, bytesRead,
+					    blockOff);
+	if (demoted && rejected)
+	{
+		// Under the shard lock, so a write can't drop it first
+		victimCache.store(uncached);
+		uncached = nullptr;
+	}
+	my_pthread_mutex_unlock(&shard.lock);
+	delete uncached;
+	return written;
+}
+
+/**
+ * Returns the number of consecutive blocks, starting at firstBlock and not
+ * going past lastBlock, that aren't in the cache or the victim cache (but
+ * at least 1).
+ */
+static size_t caching_miss_run(const FileId &file, size_t firstBlock,
+			       size_t lastBlock)
+{
+	size_t blockNum = firstBlock + 1;
+	for (; blockNum <= lastBlock && blockNum - firstBlock < IOV_MAX; 
+	     ++blockNum)
+	{
+		CacheShard &shard = shardOf(file, blockNum);
+		ScopedLock lock(&shard.lock);
+		if (shard.contains(file, blockNum) ||
+		    victimCache.contains(file, blockNum))
+		{
+			break;
+		}
+	}
+	return blockNum - firstBlock;
+}
+
+/**
+ * Open the file at fpath (path is its path in the mountdir) with the given
+ * open flags, creating it with the given mode if they say so, and keep its
+ * state in fi. A file opened for writing is known to the write back until
+ * it's released.
+ */
+static int caching_open_path(const char *path, const char *fpath, int flags,
+			     mode_t mode, struct fuse_file_info *fi)
+{
+	int ret = 0, fd;
+	bool writable = (flags & O_ACCMODE) != O_RDONLY;
+	if (writable)
+	{
+		fd = open(fpath, WRITE_OPEN_FLAGS | (flags & (O_CREAT | O_EXCL)),
+			  mode);
+	}
+	else
+	{
+		fd = open(fpath, OPEN_FLAGS);
+	}
+	if (fd < 0)
+	{
+		return -errno;
+	}
+	// The cache keys the file's blocks by its device and inode, so
+	// renaming it doesn't affect them
+	struct stat sb;
+	uint64_t generation = attrCache.generation.load();
+	if (fstat(fd, &sb) < 0)
+	{
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	FileId id{sb.st_dev, sb.st_ino};
+	if (writable && (ret = writeBack.open(id, fd, sb.st_size)) != 0)
+	{
+		close(fd);
+		return ret;
+	}
+	// Keep the open file state in the fuse_info struct, and set
+	// direct_io to 1
+	OpenFile *file = new(std::nothrow) OpenFile(fd, id, writable);
+	if (file == nullptr)
+	{
+		if (writable)
+		{
+			writeBack.release(id);
+		}
+		close(fd);
+		return -ENOMEM;
+	}
+	file->size = sb.st_size;
+	file->sizeGeneration = generation;
+	file->sizeExpires = attrCache.expiry();
+	attrCache.put(path, sb);
+	fileNames.set(id, path + 1);
+	fi->fh = (uintptr_t) file;
+	fi->direct_io = 1;
+	return 0;
+}
+
+/**
+ * Returns the size of the open file, including the writes that weren't
+ * written back yet, or -errno. The size on the disk is kept in the
+ * OpenFile, and is only taken again once it's older than attr_timeout, or
+ * the attribute cache dropped the attributes of some file since.
+ */
+static off_t caching_file_size(OpenFile *file)
+{
+	off_t size;
+	if (writeBack.fileSize(file->id, size))
+	{
+		return size;
+	}
+	uint64_t generation = attrCache.generation.load();
+	ScopedLock guard(&file->lock);
+	if (file->sizeGeneration == generation && file->sizeExpires != 0 &&
+	    monotonicNsec() < file->sizeExpires)
+	{
+		return file->size;
+	}
+	struct stat sb;
+	if (fstat(file->fd, &sb) < 0)
+	{
+		return -errno;
+	}
+	file->size = sb.st_size;
+	file->sizeGeneration = generation;
+	file->sizeExpires = attrCache.expiry();
+	return file->size;
+}
+
+/**
+ * Truncate the file (through fd if it's not negative, otherwise through
+ * fpath) from oldSize to size, and resize its cached blocks to match.
+ * Returns 0 or -errno.
+ */
+static int caching_resize(const FileId &id, int fd, const char *fpath,
+			  off_t oldSize, off_t size)
+{
+	// Nothing may be written back past the new end afterwards
+	int ret = writeBack.sync(id);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	ret = fd >= 0 ? ftruncate(fd, size) : truncate(fpath, size);
+	if (ret < 0)
+	{
+		return -errno;
+	}
+	resizeFileInCache(id, oldSize, size);
+	victimCache.drop(id, std::min(oldSize, size) / Block::size,
+			 (oldSize + Block::size - 1) / Block::size);
+	writeBack.setSize(id, size, false);
+	attrCache.invalidate(id);
+	return 0;
+}
+
 /* ========== Fuse Functions ========== */
 
 /** Get file attributes.
@@ -84,10 +545,24 @@ static bool caching_is_log_path(const string &path)
  */
 int caching_getattr(const char *path, struct stat *statbuf)
 {
+	OpTimer timer(OP_GETATTR);
 	// Write to log
 	writeToLog("getattr");	
 
 	int ret = 0;
+	if (caching_is_stats_path(path))
+	{
+		// Rendering it takes the registry lock. Its reads are direct,
+		// so they end where the snapshot open takes does anyway
+		caching_stats_attr(statbuf, STATS_FILE_MAX);
+		return 0;
+	}
+	// Paths that didn't exist a moment ago aren't even resolved
+	uint64_t generation = 0;
+	if (negativeCache.get(path, generation))
+	{
+		return -ENOENT;
+	}
 	char fpath[PATH_MAX];
 	caching_fullpath(fpath, path);
 	
@@ -96,13 +571,28 @@ int caching_getattr(const char *path, struct stat *statbuf)
 	{
 		return -ENOENT;
 	}	
-	// Fill the statbuf
-	ret = lstat(fpath, statbuf);
-	if (ret < 0)
+	// Fill the statbuf, from the attribute cache if it's there
+	if (!attrCache.get(path, *statbuf))
 	{
-		ret = -errno;
+		ret = lstat(fpath, statbuf);
+		if (ret < 0)
+		{
+			ret = -errno;
+			if (ret == -ENOENT)
+			{
+				negativeCache.put(path, generation);
+			}
+			return ret;
+		}
+		attrCache.put(path, *statbuf);
+	}
+	// Include the writes that weren't written back yet
+	off_t size;
+	if (S_ISREG(statbuf->st_mode) && writeBack.fileSize(
+			FileId{statbuf->st_dev, statbuf->st_ino}, size))
+	{
+		statbuf->st_size = size;
 	}
-
 	return ret;
 }
 
@@ -121,6 +611,7 @@ int caching_getattr(const char *path, struct stat *statbuf)
 int caching_fgetattr(const char *path, struct stat *statbuf, 
 		     struct fuse_file_info *fi)
 {
+	OpTimer timer(OP_FGETATTR);
 	// Write to log
 	writeToLog("fgetattr");	
 
@@ -134,10 +625,25 @@ int caching_fgetattr(const char *path, struct stat *statbuf,
 		return -ENOENT;
 	}	
 
-	ret = fstat(fi->fh, statbuf);
-	if (ret < 0)
+	OpenFile *file = caching_open_file(fi);
+	if (file->fd < 0)
 	{
-		ret = -errno;
+		caching_stats_attr(statbuf, file->stats.size());
+		return 0;
+	}
+	if (!attrCache.get(file->id, *statbuf))
+	{
+		ret = fstat(file->fd, statbuf);
+		if (ret < 0)
+		{
+			return -errno;
+		}
+		attrCache.put("", *statbuf);
+	}
+	off_t size;
+	if (writeBack.fileSize(file->id, size))
+	{
+		statbuf->st_size = size;
 	}
 	return ret;
 }
@@ -155,6 +661,7 @@ int caching_fgetattr(const char *path, struct stat *statbuf,
  */
 int caching_access(const char *path, int mask)
 {
+	OpTimer timer(OP_ACCESS);
 	// Write to log
 	writeToLog("access");	
 
@@ -167,6 +674,11 @@ int caching_access(const char *path, int mask)
 	{
 		return -ENOENT;
 	}
+	// The stats file is read only
+	if (caching_is_stats_path(path))
+	{
+		return (mask & (W_OK | X_OK)) != 0 ? -EACCES : 0;
+	}
 
 	ret = access(fpath, mask);
 
@@ -193,10 +705,10 @@ int caching_access(const char *path, int mask)
  */
 int caching_open(const char *path, struct fuse_file_info *fi)
 {
+	OpTimer timer(OP_OPEN);
 	// Write to log
 	writeToLog("open");	
 
-	int ret = 0, fd;
 	char fpath[PATH_MAX];
 	caching_fullpath(fpath, path);
 
@@ -205,21 +717,59 @@ int caching_open(const char *path, struct fuse_file_info *fi)
 	{
 		return -ENOENT;
 	}
-	// Make sure the file is opened in RDONLY mode
-	if ((fi->flags & 3) != O_RDONLY)
+	if (caching_is_stats_path(path))
+	{
+		// The stats file is read only
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		{
+			return -EACCES;
+		}
+		OpenFile *stats = new(std::nothrow) OpenFile(-1, FileId{0, 0});
+		if (stats == nullptr)
+		{
+			return -ENOMEM;
+		}
+		stats->stats = renderStats();
+		fi->fh = (uintptr_t) stats;
+		fi->direct_io = 1;
+		return 0;
+	}
+	return caching_open_path(path, fpath, fi->flags, 0, fi);
+}
+
+/**
+ * Create and open a file
+ *
+ * If the file does not exist, first create it with the specified
+ * mode, and then open it.
+ *
+ * If this method is not implemented or under Linux kernel
+ * versions earlier than 2.6.15, the mknod() and open() methods
+ * will be called instead.
+ *
+ * Introduced in version 2.5
+ */
+int caching_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	OpTimer timer(OP_CREATE);
+	// Write to log
+	writeToLog("create");
+
+	char fpath[PATH_MAX];
+	caching_fullpath(fpath, path);
+
+	// The log and stats files can't be replaced
+	if (caching_is_log_path(fpath) || caching_is_stats_path(path))
 	{
 		return -EACCES;
 	}
-	
-	fd = open(fpath, OPEN_FLAGS);
-	if (fd < 0)
+	int ret = caching_open_path(path, fpath, fi->flags | O_CREAT, mode, fi);
+	if (ret == 0)
 	{
-		ret = -errno;
+		// The file may be new, which changes its directory
+		attrCache.forget(path);
+		negativeCache.forget(path);
 	}
-	// Update the fd in the fuse_info struct, and set direct_io to 1
-	fi->fh = fd;
-	fi->direct_io = 1;
-	
 	return ret;
 }
 
@@ -245,25 +795,38 @@ int caching_open(const char *path, struct fuse_file_info *fi)
 int caching_read(const char *path, char *buf, size_t size, off_t offset, 
 		 struct fuse_file_info *fi)
 {
+	OpTimer timer(OP_READ);
 	// Write to log
 	writeToLog("read");
 
 	int ret = 0;
-
-	char fpath[PATH_MAX];
-	caching_fullpath(fpath, path);
-
 	size_t bytesRead = 0;		// Total bytes read
-	bool shouldStop = false;
 
 	// Get the file's size
-	struct stat sb;
-	if (fstat(fi->fh, &sb) < 0)
+	OpenFile *file = caching_open_file(fi);
+	if (file->fd < 0)
 	{
-		return -errno;
+		// The stats file, served from its snapshot
+		if ((size_t) offset >= file->stats.size())
+		{
+			return 0;
+		}
+		size = std::min(size, file->stats.size() - offset);
+		memcpy(buf, file->stats.data() + offset, size);
+		return size;
+	}
+	// The cache key of the file's blocks, no path resolving needed
+	const FileId &id = file->id;
+	off_t pendingSize;
+	uint64_t stamp;
+	bool writing = writeBack.fileSize(id, pendingSize, &stamp);
+	off_t sizeOrError = writing ? pendingSize : caching_file_size(file);
+	if (sizeOrError < 0)
+	{
+		return sizeOrError;
 	}
 
-	size_t fileSize = sb.st_size;
+	size_t fileSize = sizeOrError;
 	// If the offset is beyond the file's data, return EOF (0 bytes read)
 	if ((size_t)offset >= fileSize)
 	{
@@ -274,67 +837,300 @@ int caching_read(const char *path, char *buf, size_t size, off_t offset,
 	size_t endOffset = std::min(offset + size, fileSize), 
 	       startBlock = offset / Block::size,
 	       endBlock = (endOffset - 1) / Block::size, 
-	       currOff = 0;		// The offset in the FILE (for pread)
+	       currOff = 0,		// The offset in the FILE (for pread)
+	       blockOff = offset % Block::size; // The offset in the block
+
+	tracer.record(id, path + 1, startBlock, endBlock - startBlock + 1);
 
-	// A buffer that holds the minimal number of entire blocks that 
-	// contain all the data the user wants.
-	char *aligned_buf = (char*)malloc(Block::size * 
-			(endBlock - startBlock + 1));
+	// Track the access pattern, and read ahead in the background if the
+	// file is read sequentially. Files that are being written aren't read
+	// ahead, the disk doesn't have their latest size.
+	size_t aheadFrom = 0, aheadCount = 0;
+	if (!writing)
+	{
+		ScopedLock lock(&file->lock);
+		aheadCount = file->readahead.update(offset, endOffset,
+				(fileSize - 1) / Block::size + 1, aheadFrom);
+	}
+	if (aheadCount > 0)
+	{
+		int aheadFd = dup(file->fd);
+		if (aheadFd >= 0)
+		{
+			prefetcher.push(PrefetchRequest{aheadFd, id, 
+					aheadFrom, aheadCount});
+		}
+	}
 	
 	// For every block, check if we have it in the cache, and if not
-	// create a new Block object, read the data to it and add to cache
-	for (size_t blockNum = startBlock; blockNum <= endBlock; ++blockNum)
+	// read it from the disk, together with the missing blocks following
+	// it (with a single preadv), and add them to the cache.
+	// The data is copied straight from the cached blocks to the output
+	// buffer, so every byte is copied exactly once.
+	// A block's shard stays locked while its data is copied, so no other
+	// thread can evict it meanwhile, but not while reading from the disk.
+	size_t blockNum = startBlock, written = 0;
+	bool eof = false;
+	while (blockNum <= endBlock && !eof)
 	{
-		if (shouldStop)
+		CacheShard &shard = shardOf(id, blockNum);
+		my_pthread_mutex_lock(&shard.lock);
+		Block *block = shard.get(id, blockNum);
+		if (block != nullptr)
 		{
-			break;
+			size_t before = bytesRead;
+			written = caching_copy_block(block, buf, size, 
+						     bytesRead, blockOff);
+			my_pthread_mutex_unlock(&shard.lock);
+			countStat(STAT_HITS);
+			countStat(STAT_CACHE_BYTES, bytesRead - before);
+			blockOff = 0;
+			++blockNum;
+			// A partially written block is the last one in the file
+			eof = written < Block::size;
+			continue;
 		}
-		currOff = blockNum * Block::size;
-		if (getBlock(fpath, blockNum) == NOT_IN_CACHE)
+		my_pthread_mutex_unlock(&shard.lock);
+
+		// Read the whole run of missing blocks into new blocks,
+		// unless they are being read ahead or by another read right
+		// now, in which case they may be cached once it's done
+		size_t runLength = caching_miss_run(id, blockNum, 
+						    endBlock);
+		if (prefetcher.claim(id, blockNum, runLength))
+		{
+			continue;
+		}
+		runLength = inFlight.claim(id, blockNum, runLength);
+		if (runLength == 0)
+		{
+			continue;
+		}
+		my_pthread_mutex_lock(&shard.lock);
+		// Another read may have cached it since it was missed
+		bool cached = shard.contains(id, blockNum);
+		my_pthread_mutex_unlock(&shard.lock);
+		if (cached)
 		{
-			Block newBlock(fpath, blockNum);
-			ret = pread(fi->fh, newBlock.data, Block::size, 
-					currOff);
-			if (ret < 0)
+			inFlight.release(id, blockNum, runLength);
+			continue;
+		}
+
+		// The block may have been evicted to the victim cache
+		Block *demoted = victimCache.fetch(id, blockNum);
+		if (demoted != nullptr)
+		{
+			written = caching_fill_block(id, demoted, stamp, buf, 
+						     size, bytesRead, blockOff,
+						     true);
+			inFlight.release(id, blockNum, runLength);
+			blockOff = 0;
+			++blockNum;
+			eof = written < Block::size;
+			continue;
+		}
+
+		writeBack.waitForWrites(id);
+		vector<Block*> run;
+		vector<struct iovec> iov;
+		for (size_t i = 0; i < runLength; ++i)
+		{
+			Block *newBlock = allocBlock(id, blockNum + i);
+			if (newBlock == nullptr)
 			{
-				return -errno;
-			} // From here, ret is non-negative...
-			else if (ret == 0)
+				break;
+			}
+			run.push_back(newBlock);
+			iov.push_back({newBlock->data, Block::size});
+		}
+		currOff = blockNum * Block::size;
+		ssize_t got = -1;
+		errno = ENOMEM;
+		if (run.size() == runLength)
+		{
+			got = preadv(file->fd, iov.data(), iov.size(), currOff);
+		}
+		if (got < 0)
+		{
+			ret = -errno;
+			for (Block *newBlock : run)
 			{
-				break; // Means EOF
+				delete newBlock;
 			}
-			else
+			inFlight.release(id, blockNum, runLength);
+			return ret;
+		}
+
+		countStat(STAT_DISK_BYTES, got);
+
+		// Cache the blocks that got data and copy from them
+		size_t remaining = got;
+		for (Block *newBlock : run)
+		{
+			// The disk may not have the writes that extended 
+			// the file yet, they read as zeros till then
+			size_t fromDisk = std::min(remaining, Block::size),
+			       valid = !writing ? fromDisk : 
+				std::min(Block::size, fileSize - 
+					 std::min(fileSize, currOff));
+			remaining -= fromDisk;
+			currOff += Block::size;
+			if (eof || valid == 0) // Means EOF
 			{
-				newBlock.written = ret;
+				eof = true;
+				delete newBlock;
+				continue;
 			}
-			addToCache(std::move(newBlock));
-			if ((size_t)ret < Block::size)
+			if (fromDisk < valid)
 			{
-				shouldStop = true;
+				memset(newBlock->data + fromDisk, 0, 
+				       valid - fromDisk);
 			}
+			newBlock->written = valid;
+			countStat(STAT_MISSES);
+			written = caching_fill_block(id, newBlock, stamp, buf,
+						     size, bytesRead, blockOff);
+			blockOff = 0;
+			eof = written < Block::size;
 		}
-		// Now assuming that the relevant block is cached and on top
-		// of the stack (back of the cache vector), copy the data
-		// from the cached block to the buffer.
-		memcpy(aligned_buf + (blockNum - startBlock) * Block::size, 
-				cache.back().data,
-				cache.back().written);
-		bytesRead += cache.back().written;
-	}
-	// Remove the extra data read from the first block
-	bytesRead -= offset % Block::size;
-	if (bytesRead > size)
-	{
-		// remove extra data from last block's end, only if such
-		// exists...
-		bytesRead = size;
-	}
-	// Move data to output buffer and free allocated memory
-	memcpy(buf, aligned_buf + offset % Block::size, bytesRead);
-	free(aligned_buf);
+		inFlight.release(id, blockNum, runLength);
+		blockNum += runLength;
+	}
 	return bytesRead;
 }
 
+/** Write data to an open file
+ *
+ * Write should return exactly the number of bytes requested
+ * except on error.
+ *
+ * The data is only copied into cached blocks, which are marked dirty and
+ * written back later (see WriteBack.h). A block the write only changes 
+ * part of is read from the disk first, unless it's cached.
+ *
+ * Changed in version 2.2
+ */
+int caching_write(const char *, const char *buf, size_t size, off_t offset,
+		  struct fuse_file_info *fi)
+{
+	OpTimer timer(OP_WRITE);
+	// Write to log
+	writeToLog("write");
+
+	OpenFile *file = caching_open_file(fi);
+	if (!file->writable)
+	{
+		return -EBADF;
+	}
+	if (size == 0)
+	{
+		return 0;
+	}
+	const FileId &id = file->id;
+	off_t oldSize = caching_file_size(file);
+	if (oldSize < 0)
+	{
+		return oldSize;
+	}
+	writeBack.throttle();
+
+	size_t endOffset = offset + size, copied = 0;
+	for (size_t blockNum = offset / Block::size;
+	     blockNum * Block::size < endOffset; ++blockNum)
+	{
+		size_t blockStart = blockNum * Block::size,
+		       blockOff = std::max((size_t) offset, blockStart) - 
+				blockStart,
+		       toCopy = std::min(Block::size, endOffset - blockStart) -
+				blockOff,
+		       // The bytes the file already has in the block
+		       valid = std::min(Block::size, (size_t) oldSize -
+				std::min((size_t) oldSize, blockStart));
+
+		CacheShard &shard = shardOf(id, blockNum);
+		uint64_t stamp = writeBack.stamp(id);
+		my_pthread_mutex_lock(&shard.lock);
+		Block *block = shard.get(id, blockNum);
+		while (block == nullptr)
+		{
+			my_pthread_mutex_unlock(&shard.lock);
+			prefetcher.claim(id, blockNum, 1);
+			writeBack.waitForWrites(id);
+			Block *newBlock = allocBlock(id, blockNum);
+			if (newBlock == nullptr)
+			{
+				return copied > 0 ? (int) copied : -ENOMEM;
+			}
+			size_t fromDisk = 0;
+			if (valid > 0 && (blockOff > 0 || 
+			    blockOff + toCopy < valid))
+			{
+				ssize_t got = pread(file->fd, newBlock->data,
+						    valid, blockStart);
+				if (got < 0)
+				{
+					int ret = -errno;
+					delete newBlock;
+					return copied > 0 ? (int) copied : ret;
+				}
+				fromDisk = got;
+				countStat(STAT_DISK_BYTES, got);
+			}
+			if (fromDisk < valid)
+			{
+				memset(newBlock->data + fromDisk, 0,
+				       valid - fromDisk);
+			}
+			newBlock->written = valid;
+			my_pthread_mutex_lock(&shard.lock);
+			// Another thread may have cached it in the meantime
+			block = shard.get(id, blockNum);
+			if (block != nullptr)
+			{
+				delete newBlock;
+			}
+			else if (writeBack.stamp(id) != stamp)
+			{
+				// A racing write of the block may have been
+				// written back after the disk was read
+				delete newBlock;
+				stamp = writeBack.stamp(id);
+			}
+			else
+			{
+				block = shard.add(newBlock);
+			}
+		}
+		if (blockOff > block->written)
+		{
+			memset(block->data + block->written, 0,
+			       blockOff - block->written);
+		}
+		memcpy(block->data + blockOff, buf + copied, toCopy);
+		block->written = std::max(block->written, blockOff + toCopy);
+		if (!block->dirty)
+		{
+			// Its copy in the victim cache, if any, is stale now
+			victimCache.drop(id, blockNum, blockNum + 1);
+			block->dirty = writeBack.markDirty(id, blockNum);
+		}
+		my_pthread_mutex_unlock(&shard.lock);
+		copied += toCopy;
+	}
+	countStat(STAT_WRITE_BYTES, copied);
+
+	if (endOffset > (size_t) oldSize)
+	{
+		// The block the old end was in must not look like the end
+		resizeFileInCache(id, oldSize, endOffset);
+		victimCache.drop(id, oldSize / Block::size,
+				 oldSize / Block::size + 1);
+		writeBack.setSize(id, endOffset, true);
+		attrCache.invalidate(id);
+	}
+	return copied;
+}
+
 /** Possibly flush cached data
  *
  * BIG NOTE: This is not equivalent to fsync().  It's not a
@@ -360,12 +1156,40 @@ int caching_read(const char *path, char *buf, size_t size, off_t offset,
  */
 int caching_flush(const char *, struct fuse_file_info *)
 {
+	OpTimer timer(OP_FLUSH);
 	// Write to log
 	writeToLog("flush");	
 
 	return 0;
 }
 
+/** Synchronize file contents
+ *
+ * If the datasync parameter is non-zero, then only the user data
+ * should be flushed, not the meta data.
+ *
+ * Changed in version 2.2
+ */
+int caching_fsync(const char *, int datasync, struct fuse_file_info *fi)
+{
+	OpTimer timer(OP_FSYNC);
+	// Write to log
+	writeToLog("fsync");
+
+	OpenFile *file = caching_open_file(fi);
+	if (file->fd < 0)
+	{
+		return 0;
+	}
+	int ret = writeBack.sync(file->id);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	ret = datasync ? fdatasync(file->fd) : fsync(file->fd);
+	return ret < 0 ? -errno : 0;
+}
+
 /** Release an open file
  *
  * Release is called when there are no more references to an open
@@ -382,10 +1206,24 @@ int caching_flush(const char *, struct fuse_file_info *)
  */
 int caching_release(const char *, struct fuse_file_info *fi)
 {
+	OpTimer timer(OP_RELEASE);
 	// Write to log
 	writeToLog("release");	
 
-	return close(fi->fh);
+	OpenFile *file = caching_open_file(fi);
+	// Write back whatever this file wrote, which changed its mtime
+	int ret = 0;
+	if (file->writable)
+	{
+		ret = writeBack.release(file->id);
+		attrCache.invalidate(file->id);
+	}
+	if (file->fd >= 0 && close(file->fd) < 0 && ret == 0)
+	{
+		ret = -errno;
+	}
+	delete file;
+	return ret;
 }
 
 /** Open directory
@@ -397,11 +1235,10 @@ int caching_release(const char *, struct fuse_file_info *fi)
  */
 int caching_opendir(const char *path, struct fuse_file_info *fi)
 {
+	OpTimer timer(OP_OPENDIR);
 	// Write to log
 	writeToLog("opendir");	
 
-	DIR *dirp;
-	int ret = 0;
 	char fpath[PATH_MAX];
 	caching_fullpath(fpath, path);
 
@@ -411,15 +1248,33 @@ int caching_opendir(const char *path, struct fuse_file_info *fi)
 		return -ENOENT;
 	}
 
-	dirp = opendir(fpath);
-	if (dirp == nullptr)
+	// The attributes are taken before the directory is read, so a
+	// listing is never cached with times older than its contents
+	OpenDir *dir = new OpenDir{nullptr, {}, nullptr};
+	if (stat(fpath, &dir->st) != 0)
 	{
-		ret = -errno;
+		int ret = -errno;
+		delete dir;
+		return ret;
 	}
-	// Update fd
-	fi->fh = (intptr_t) dirp;
-
-	return ret;
+	if (!S_ISDIR(dir->st.st_mode))
+	{
+		delete dir;
+		return -ENOTDIR;
+	}
+	dir->listing = dirCache.get(dir->st);
+	if (dir->listing == nullptr)
+	{
+		dir->dirp = opendir(fpath);
+		if (dir->dirp == nullptr)
+		{
+			int ret = -errno;
+			delete dir;
+			return ret;
+		}
+	}
+	fi->fh = (intptr_t) dir;
+	return 0;
 }
 
 /** Read directory
@@ -438,32 +1293,48 @@ int caching_opendir(const char *path, struct fuse_file_info *fi)
 int caching_readdir(const char *, void *buf, fuse_fill_dir_t filler, 
 		    off_t, struct fuse_file_info *fi)
 {
+	OpTimer timer(OP_READDIR);
 	// Write to log
 	writeToLog("readdir");	
 
-	int ret = 0;
-	DIR *dirp;
-	struct dirent *dent;
-	dirp = (DIR*) (uintptr_t) fi->fh;
-	// If first entry is null, an error occured
-	dent = readdir(dirp);
-	if (dent == nullptr)
-	{
-		return -errno;
-	}
-	do
+	OpenDir *dir = (OpenDir*) (uintptr_t) fi->fh;
+	if (dir->listing == nullptr)
 	{
-		// don't list log
-		if (caching_is_log_path(dent->d_name))
+		// Read the directory, without the log, into a new listing
+		DirListing *listing = new DirListing(dir->st);
+		struct dirent *dent;
+		errno = 0;
+		while ((dent = readdir(dir->dirp)) != nullptr)
 		{
-			continue;
+			if (!caching_is_log_path(dent->d_name))
+			{
+				listing->add(dent->d_name, dent->d_ino,
+					     dent->d_type);
+			}
 		}
-		if (filler(buf, dent->d_name, nullptr, 0) != 0)
+		// An empty listing means an error, there's always a "."
+		if (errno != 0 || listing->entries.empty())
+		{
+			int ret = errno != 0 ? -errno : -EIO;
+			delete listing;
+			return ret;
+		}
+		dir->listing = DirListingPtr(listing);
+		dirCache.put(dir->st, dir->listing);
+	}
+
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	for (const DirEntry &entry : dir->listing->entries)
+	{
+		st.st_ino = entry.ino;
+		st.st_mode = entry.mode;
+		if (filler(buf, dir->listing->name(entry), &st, 0) != 0)
 		{
 			return -ENOMEM;
 		}
-	} while ((dent = readdir(dirp)) != nullptr);
-	return ret;
+	}
+	return 0;
 }
 
 /** Release directory
@@ -472,15 +1343,20 @@ int caching_readdir(const char *, void *buf, fuse_fill_dir_t filler,
  */
 int caching_releasedir(const char *, struct fuse_file_info *fi)
 {
+	OpTimer timer(OP_RELEASEDIR);
 	// Write to log
 	writeToLog("releasedir");	
 
-	return closedir((DIR*) (uintptr_t) fi->fh);
+	OpenDir *dir = (OpenDir*) (uintptr_t) fi->fh;
+	int ret = dir->dirp != nullptr ? closedir(dir->dirp) : 0;
+	delete dir;
+	return ret;
 }
 
 /** Rename a file */
 int caching_rename(const char *path, const char *newpath)
 {
+	OpTimer timer(OP_RENAME);
 	// Write to log
 	writeToLog("rename");	
 	
@@ -492,16 +1368,103 @@ int caching_rename(const char *path, const char *newpath)
 	{
 		return -ENOENT;
 	}
+	if (caching_is_stats_path(path) || caching_is_stats_path(newpath))
+	{
+		return -EACCES;
+	}
 
 	caching_fullpath(fnewpath, newpath);
+	// The cache keys blocks by inode, so the renamed file keeps its
+	// blocks. Only a file the rename replaces loses its blocks, since its
+	// inode is freed (unless it has other links) and may be reused.
+	struct stat replaced;
+	bool replacing = lstat(fnewpath, &replaced) == 0 && 
+		S_ISREG(replaced.st_mode) && replaced.st_nlink == 1;
 	ret = rename(fpath, fnewpath);
-	if (ret == 0)	// Check if renaming failed.
-	{	// otherwise update cache blocks
-		renameInCache(fpath, fnewpath);
+	if (ret < 0)	// Check if renaming failed.
+	{
+		return -errno;
 	}
+	if (replacing)
+	{
+		struct stat renamed;
+		FileId id{replaced.st_dev, replaced.st_ino};
+		// Renaming a link onto another link of the same file is a no-op
+		if (lstat(fnewpath, &renamed) != 0 ||
+		    renamed.st_ino != replaced.st_ino ||
+		    renamed.st_dev != replaced.st_dev)
+		{
+			// It may still be written through an open file
+			writeBack.sync(id);
+			removeFileFromCache(id);
+			victimCache.drop(id, 0, SIZE_MAX);
+			fileNames.erase(id);
+		}
+	}
+	fileNames.rename(path + 1, newpath + 1);
+	// Any cached path may go through what was renamed
+	pathCache.clear();
+	attrCache.forget(path);
+	attrCache.forget(newpath);
+	negativeCache.forget(newpath, true);
 	return ret;
 }
 
+/** Change the size of a file */
+int caching_truncate(const char *path, off_t size)
+{
+	OpTimer timer(OP_TRUNCATE);
+	// Write to log
+	writeToLog("truncate");
+
+	char fpath[PATH_MAX];
+	caching_fullpath(fpath, path);
+	if (caching_is_log_path(fpath))
+	{
+		return -ENOENT;
+	}
+	if (caching_is_stats_path(path))
+	{
+		return -EACCES;
+	}
+	struct stat sb;
+	if (lstat(fpath, &sb) < 0)
+	{
+		return -errno;
+	}
+	FileId id{sb.st_dev, sb.st_ino};
+	off_t oldSize = sb.st_size;
+	writeBack.fileSize(id, oldSize);
+	return caching_resize(id, -1, fpath, oldSize, size);
+}
+
+/**
+ * Change the size of an open file
+ *
+ * This method is called instead of the truncate() method if the
+ * truncation was invoked from an ftruncate() system call.
+ *
+ * Introduced in version 2.5
+ */
+int caching_ftruncate(const char *, off_t size, struct fuse_file_info *fi)
+{
+	OpTimer timer(OP_FTRUNCATE);
+	// Write to log
+	writeToLog("ftruncate");
+
+	OpenFile *file = caching_open_file(fi);
+	if (!file->writable)
+	{
+		return file->fd < 0 ? -EACCES : -EBADF;
+	}
+	off_t oldSize = caching_file_size(file);
+	if (oldSize < 0)
+	{
+		return oldSize;
+	}
+	return caching_resize(file->id, file->fd, nullptr, oldSize, size);
+}
+
 /**
  * Initialize filesystem
  *
@@ -519,6 +1482,16 @@ For your task, the function needs to return NULL always
  */
 void *caching_init(struct fuse_conn_info *)
 {
+	// Threads must be started here and not in main, since fuse may fork
+	// to the background after main.
+	prefetcher.start();
+	writeBack.start();
+	victimCache.start();
+	if (compressBlocks)
+	{
+		packer.start();
+	}
+	opLog.start(CACHING_STATE->logfile, &CACHING_STATE->logLock);
 	return CACHING_STATE;
 }
 
@@ -535,7 +1508,25 @@ If a failure occurs in this function, do nothing
  */
 void caching_destroy(void *userdata)
 {
-	cache.clear(); // This frees cached blocks' data!
+	prefetcher.stop();
+	packer.stop();
+	// Write back all the dirty blocks, before they're saved or freed
+	writeBack.stop();
+	tracer.close();
+	if (!snapshotPath.empty())
+	{
+		saveSnapshot(snapshotPath, ((CachingState*) userdata)->rootdir,
+			     [](const FileId &id, string &path)
+			     {
+				     return fileNames.find(id, path);
+			     });
+	}
+	evictCleanBlock = nullptr;
+	destroyCache(); // This frees cached blocks' data!
+	victimCache.close();
+	blockArena.destroy();
+	// Write the last records before the log is closed
+	opLog.stop();
 	delete (CachingState*) userdata;	
 }
 
@@ -557,19 +1548,41 @@ void caching_destroy(void *userdata)
 int caching_ioctl(const char *, int, void *, struct fuse_file_info *, 
 		  unsigned int, void *)
 {
+	OpTimer timer(OP_IOCTL);
 	writeToLog("ioctl");	
-	string rel_path, rootpath = CACHING_STATE->rootdir;
+	// Keep the dump in one piece in the log, after the records that
+	// are still on their way to it
+	ScopedLock lock(&CACHING_STATE->logLock);
+	opLog.drain();
 
-	for (size_t i = 0; i < cache.size(); ++i)
+	forEachBlock([&](const Block &block)
 	{
-		rel_path = cache[i].filename; // Exclude rootpath
-		if (rel_path.find(rootpath) != string::npos)
-		{
-			rel_path = rel_path.substr(rootpath.length() + 1);
-		}
-		CACHING_STATE->logfile << rel_path << DELIM 
-			<< cache[i].number + 1 << DELIM 
-			<< cache[i].refCount << endl;
+		// The path relative to the rootdir
+		CACHING_STATE->logfile << fileNames.get(block.file) << DELIM 
+			<< block.number + 1 << DELIM 
+			<< block.refCount << endl;
+	});
+	if (compressBlocks)
+	{
+		// What the compression gained, and what the hits paid for it
+		size_t blocks, packed, bytes, maxBytes;
+		cacheMemory(blocks, packed, bytes, maxBytes);
+		ThreadStats total(false);
+		statsRegistry.sum(total);
+		uint64_t unpacked = total.counters[STAT_UNPACKED].load(
+				std::memory_order_relaxed),
+			 unpackNsec = total.counters[STAT_UNPACK_NSEC].load(
+				std::memory_order_relaxed);
+		char line[COMPRESSION_LINE_MAX];
+		snprintf(line, sizeof(line), "compression: %zu of %zu blocks "
+			 "compressed, %zu bytes of blocks in %zu bytes of "
+			 "memory (of %zu), %.2fx the capacity; %llu "
+			 "decompressions, %.2f us each", packed, blocks,
+			 blocks * Block::size, bytes, maxBytes,
+			 bytes == 0 ? 1.0 : (double) blocks * Block::size /
+			 bytes, (unsigned long long) unpacked, unpacked == 0 ?
+			 0.0 : unpackNsec / NSEC_PER_USEC / unpacked);
+		CACHING_STATE->logfile << line << endl;
 	}
 	return 0;
 }
@@ -594,6 +1607,11 @@ void init_caching_oper()
 	caching_oper.destroy = caching_destroy;
 	caching_oper.ioctl = caching_ioctl;
 	caching_oper.fgetattr = caching_fgetattr;
+	caching_oper.write = caching_write;
+	caching_oper.create = caching_create;
+	caching_oper.truncate = caching_truncate;
+	caching_oper.ftruncate = caching_ftruncate;
+	caching_oper.fsync = caching_fsync;
 
 
 	caching_oper.readlink = NULL;
@@ -606,18 +1624,13 @@ void init_caching_oper()
 	caching_oper.link = NULL;
 	caching_oper.chmod = NULL;
 	caching_oper.chown = NULL;
-	caching_oper.truncate = NULL;
 	caching_oper.utime = NULL;
-	caching_oper.write = NULL;
 	caching_oper.statfs = NULL;
-	caching_oper.fsync = NULL;
 	caching_oper.setxattr = NULL;
 	caching_oper.getxattr = NULL;
 	caching_oper.listxattr = NULL;
 	caching_oper.removexattr = NULL;
 	caching_oper.fsyncdir = NULL;
-	caching_oper.create = NULL;
-	caching_oper.ftruncate = NULL;
 }
 
 /**
@@ -657,7 +1670,8 @@ int main(int argc, char* argv[])
 	{
 		caching_usage();
 	}
-	// Init static constant and private data
+	// Init static constant and private data (-o block_size= may
+	// change the block size)
 	Block::size = sb.st_blksize;
 	CachingState *cachingData = new(std::nothrow) CachingState(rootdir);
 	if (cachingData == nullptr)
@@ -665,17 +1679,144 @@ int main(int argc, char* argv[])
 		caching_syserror("new operator");
 	}
 
-	init_caching_oper();
+	// Pass the mountdir and any extra arguments (e.g. -s to run single
+	// threaded, or -f to stay in the foreground) on to fuse, except for
+	// our own mount options.
+	argv[1] = argv[MOUNT_ARG];
+	for (int i = NUM_ARGS; i < argc; ++i)
+	{
+		argv[i - NUM_ARGS + 2] = argv[i];
+	}
+	argc -= NUM_ARGS - 2;
+	argv[argc] = NULL;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	CachingOptions options = {nullptr, nullptr, 0, nullptr,
+				  DEF_DIRTY_EXPIRE_MSEC, 
+				  (int) (maxSize / DEF_DIRTY_CACHE_SHARE),
+				  DEF_ATTR_TIMEOUT, UNSET_TIMEOUT, nullptr, DEF_LOG_SAMPLE,
+				  nullptr, nullptr,
+				  (int) (maxSize * DEF_VICTIM_CACHE_SHARE), 0, 0};
+	if (fuse_opt_parse(&args, &options, caching_opts, nullptr) != 0 ||
+	    (options.policy != nullptr && !isPolicyName(options.policy)) ||
+	    (options.admission != nullptr &&
+	     !isAdmissionName(options.admission)) ||
+	    options.dirtyExpire < 0 || options.dirtyMax < 0 ||
+	    options.attrTimeout < 0 || options.victimBlocks < 0 ||
+	    (options.negativeTimeout < 0 &&
+	     options.negativeTimeout != UNSET_TIMEOUT))
+	{
+		caching_usage();
+	}
+	if (options.blockSize != 0)
+	{
+		// Whole blocks of the rootdir, so reads with O_DIRECT stay
+		// aligned, and a power of two for the arena's buffers
+		if (options.blockSize % Block::size != 0 ||
+		    (options.blockSize & (options.blockSize - 1)) != 0 ||
+		    options.blockSize > MAX_BLOCK_SIZE)
+		{
+			caching_usage();
+		}
+		Block::size = options.blockSize;
+	}
+	LogLevel logLevel = LOG_ALL;
+	if (options.logLevel != nullptr)
+	{
+		bool valid = parseLogLevel(options.logLevel, logLevel);
+		free(options.logLevel);
+		if (!valid)
+		{
+			caching_usage();
+		}
+	}
+	opLog.configure(logLevel, options.logSample);
+	if (options.policy != nullptr)
+	{
+		policyName = options.policy;
+		free(options.policy);
+	}
+	// Only FBR tells which blocks left its new section, and hits
+	// decompress under the shard lock, so the blocks must be small
+	if (options.compress != 0 && ((policyName != POLICY_FBR &&
+	    policyName != POLICY_ADAPTIVE_FBR) ||
+	    Block::size > COMPRESS_MAX_BLOCK_SIZE))
+	{
+		caching_usage();
+	}
+	compressBlocks = options.compress != 0;
+	if (options.admission != nullptr)
+	{
+		admissionFilter = strcmp(options.admission, 
+					 ADMISSION_TINYLFU) == 0;
+		free(options.admission);
+	}
+	if (options.victimCache != nullptr)
+	{
+		if (!victimCache.open(options.victimCache, options.victimBlocks))
+		{
+			caching_syserror("open");
+		}
+		free(options.victimCache);
+	}
+	if (options.trace != nullptr)
+	{
+		if (!tracer.open(options.trace, Block::size))
+		{
+			caching_syserror("fopen");
+		}
+		free(options.trace);
+	}
+	if (options.snapshot != nullptr)
+	{
+		// Saved on unmount, after fuse changed the working directory
+		char cwd[PATH_MAX];
+		snapshotPath = options.snapshot;
+		if (snapshotPath[0] != '/' && getcwd(cwd, sizeof(cwd)) != nullptr)
+		{
+			snapshotPath = string(cwd) + "/" + snapshotPath;
+		}
+		free(options.snapshot);
+	}
 
-	argv[1] = argv[2];
-	for (int i = 2; i < (argc - 1); i++)
+	// All the block buffers come from one region, mapped now
+	size_t spareBlocks = std::max((size_t) ARENA_MIN_SPARE_BLOCKS,
+				      ARENA_SPARE_BYTES / Block::size);
+	if (!blockArena.init(maxSize + spareBlocks, Block::size,
+			     options.hugePages != 0))
 	{
-		argv[i] = NULL;
+		caching_syserror("mmap");
 	}
-        argv[2] = (char*) "-s";
-	//argv[3] = (char*) "-f";	// <<===== For Valgrind! =======
-	argc = 3; // 4;
-	
-	int fuse_stat = fuse_main(argc, argv, &caching_oper, cachingData);
+	initCache();
+	writeBack.configure(options.dirtyExpire, options.dirtyMax);
+	attrCache.configure(options.attrTimeout);
+	if (options.negativeTimeout == UNSET_TIMEOUT)
+	{
+		// fuse doesn't cache missing paths by default, tell it ours
+		options.negativeTimeout = DEF_NEGATIVE_TIMEOUT;
+		fuse_opt_add_arg(&args, ("-onegative_timeout=" + 
+			std::to_string(options.negativeTimeout)).c_str());
+	}
+	negativeCache.configure(options.negativeTimeout);
+	evictDirtyBlock = writeBackEvicted;
+	evictCleanBlock = demoteBlock;
+	if (compressBlocks)
+	{
+		packCooledBlock = packLater;
+	}
+	if (!snapshotPath.empty())
+	{
+		// A missing or invalid snapshot just leaves the cache cold
+		loadSnapshot(snapshotPath, rootdir,
+			     [](const FileId &id, const string &path)
+			     {
+				     fileNames.set(id, path);
+			     });
+	}
+
+	init_caching_oper();
+
+	int fuse_stat = fuse_main(args.argc, args.argv, &caching_oper,
+				  cachingData);
+	fuse_opt_free_args(&args);
 	return fuse_stat;
 }
@@ -0,0 +1,376 @@
+/**
+ * Compression of cold blocks (-o compress). Blocks that FBR moves out of
+ * its new section are compressed in place: their data goes back to the
+ * arena and the block keeps a smaller heap buffer instead, until a hit
+ * decompresses it. The codec is a small LZ77 in the style of LZ4 (literal
+ * runs and matches of at least 4 bytes up to 64KB back, found through a
+ * hash of every position's next 4 bytes), which does well on text, logs
+ * and JSON. Compressing a 4KB block takes about 10us, so it's done by the
+ * packer thread (see Packer.h) without holding the shard lock.
+ * Decompressing one takes a few us, but it's done by the hit that needs
+ * the data, under the shard lock, so -o compress is only for blocks of up
+ * to COMPRESS_MAX_BLOCK_SIZE.
+ * Each sequence is a token byte (the literal run's length in its high
+ * nibble and the match's length minus 4 in its low one, 15 meaning more
+ * length bytes follow), the literals, and the match's 2 byte offset. The
+ * last sequence only has literals.
+ */
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include "Block.h"
+#include "Stats.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+#define LZ_HASH_MULTIPLIER 2654435761U
+#define LZ_NIBBLE_MAX 15	// A length nibble that more length bytes follow
+#define LZ_BYTE_MAX 255		// A length byte that another one follows
+#define LZ_SKIP_SHIFT 6		// Misses grow the step, to skip random data
+#define LZ_COPY_CHUNK 16	// See lzWildCopy
+#define PACK_MAX_PERCENT 75	// Blocks that don't compress below that much
+				// of their buffer stay as they are
+#define PACKED_MAX_SHARE 4	// A compressing cache holds at most 4 times
+				// the blocks its memory holds uncompressed
+#define COMPRESS_MAX_BLOCK_SIZE (64 * 1024)
+
+static bool compressBlocks = false;	// Set by -o compress
+
+/**
+ * Write the length of a literal run or a match past its nibble, if it
+ * didn't fit in it.
+ */
+static void lzPutLength(uint8_t *&out, size_t length)
+{
+	if (length < LZ_NIBBLE_MAX)
+	{
+		return;
+	}
+	for (length -= LZ_NIBBLE_MAX; length >= LZ_BYTE_MAX;
+	     length -= LZ_BYTE_MAX)
+	{
+		*out++ = LZ_BYTE_MAX;
+	}
+	*out++ = (uint8_t) length;
+}
+
+/**
+ * Read a length that didn't fit in its nibble and add it to length.
+ * Returns false if the input ends first.
+ */
+static bool lzGetLength(const uint8_t *&in, const uint8_t *end,
+			size_t &length)
+{
+	if (length < LZ_NIBBLE_MAX)
+	{
+		return true;
+	}
+	uint8_t byte;
+	do
+	{
+		if (in == end)
+		{
+			return false;
+		}
+		byte = *in++;
+		length += byte;
+	} while (byte == LZ_BYTE_MAX);
+	return true;
+}
+
+/**
+ * Copy length bytes from src to dst in chunks of LZ_COPY_CHUNK bytes,
+ * which the compiler turns into a few moves, instead of calling memcpy
+ * for every short run. It may read and write up to LZ_COPY_CHUNK - 1 bytes
+ * past them, so the caller must make sure both have room for that, and
+ * if they overlap, src must be at least LZ_COPY_CHUNK bytes before dst.
+ */
+static void lzWildCopy(uint8_t *dst, const uint8_t *src, size_t length)
+{
+	for (size_t i = 0; i < length; i += LZ_COPY_CHUNK)
+	{
+		memcpy(dst + i, src + i, LZ_COPY_CHUNK);
+	}
+}
+
+/**
+ * Write one sequence: the literals (which are followed by inEnd - literals
+ * bytes of input), and then the match at offset back of matchLength bytes
+ * unless matchLength is 0 (the last sequence). Returns false if it doesn't
+ * fit before end.
+ */
+static bool lzPutSequence(uint8_t *&out, const uint8_t *end,
+			  const uint8_t *literals, const uint8_t *inEnd,
+			  size_t literalLength, size_t offset,
+			  size_t matchLength)
+{
+	size_t matchCode = matchLength == 0 ? 0 : matchLength - LZ_MIN_MATCH;
+	// The token, the length bytes at worst, the literals and the offset
+	if ((size_t) (end - out) < 1 + literalLength / LZ_BYTE_MAX + 1 +
+	    literalLength + 2 + matchCode / LZ_BYTE_MAX + 1)
+	{
+		return false;
+	}
+	*out++ = (uint8_t) (std::min(literalLength, (size_t) LZ_NIBBLE_MAX)
+			    << 4 | std::min(matchCode, (size_t) LZ_NIBBLE_MAX));
+	lzPutLength(out, literalLength);
+	if ((size_t) (end - out) >= literalLength + LZ_COPY_CHUNK &&
+	    (size_t) (inEnd - literals) >= literalLength + LZ_COPY_CHUNK)
+	{
+		lzWildCopy(out, literals, literalLength);
+	}
+	else
+	{
+		memcpy(out, literals, literalLength);
+	}
+	out += literalLength;
+	if (matchLength != 0)
+	{
+		*out++ = (uint8_t) offset;
+		*out++ = (uint8_t) (offset >> 8);
+		lzPutLength(out, matchCode);
+	}
+	return true;
+}
+
+/**
+ * Returns the 4 bytes at p.
+ */
+static uint32_t lzRead32(const uint8_t *p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+/**
+ * Returns how many bytes at match and at p (up to max) are the same,
+ * given that the first LZ_MIN_MATCH are. Compares 8 bytes at a time.
+ */
+static size_t lzMatchLength(const uint8_t *match, const uint8_t *p,
+			    size_t max)
+{
+	size_t length = LZ_MIN_MATCH;
+	while (length + sizeof(uint64_t) <= max)
+	{
+		uint64_t a, b;
+		memcpy(&a, match + length, sizeof(a));
+		memcpy(&b, p + length, sizeof(b));
+		if (a != b)
+		{
+			// The first differing byte, on a little endian CPU
+			return length + __builtin_ctzll(a ^ b) / 8;
+		}
+		length += sizeof(uint64_t);
+	}
+	while (length < max && match[length] == p[length])
+	{
+		++length;
+	}
+	return length;
+}
+
+/**
+ * Compress size bytes of src into dst, which has room for capacity bytes.
+ * Returns the compressed size, or 0 if it's more than capacity.
+ */
+size_t lzCompress(const char *src, size_t size, char *dst, size_t capacity)
+{
+	uint32_t table[1 << LZ_HASH_BITS];	// Hash -> last position + 1
+	memset(table, 0, sizeof(table));
+	const uint8_t *in = (const uint8_t*) src;
+	uint8_t *out = (uint8_t*) dst, *end = out + capacity;
+	size_t pos = 0, anchor = 0;	// anchor: where the literals start
+	while (pos + LZ_MIN_MATCH <= size)
+	{
+		uint32_t next = lzRead32(in + pos);
+		uint32_t &slot = table[(next * LZ_HASH_MULTIPLIER) >>
+				       (32 - LZ_HASH_BITS)];
+		size_t candidate = slot;
+		slot = pos + 1;
+		if (candidate == 0 || pos + 1 - candidate > LZ_MAX_OFFSET ||
+		    lzRead32(in + candidate - 1) != next)
+		{
+			pos += 1 + ((pos - anchor) >> LZ_SKIP_SHIFT);
+			continue;
+		}
+		--candidate;
+		size_t length = lzMatchLength(in + candidate, in + pos,
+					      size - pos);
+		if (!lzPutSequence(out, end, in + anchor, in + size,
+				   pos - anchor, pos - candidate, length))
+		{
+			return 0;
+		}
+		pos += length;
+		anchor = pos;
+	}
+	if (!lzPutSequence(out, end, in + anchor, in + size, size - anchor,
+			   0, 0))
+	{
+		return 0;
+	}
+	return out - (uint8_t*) dst;
+}
+
+/**
+ * Decompress the srcSize bytes at src, which must decompress to exactly
+ * size bytes, into dst. Returns false if they don't.
+ */
+bool lzDecompress(const char *src, size_t srcSize, char *dst, size_t size)
+{
+	const uint8_t *in = (const uint8_t*) src, *inEnd = in + srcSize;
+	uint8_t *out = (uint8_t*) dst, *outEnd = out + size;
+	while (in < inEnd)
+	{
+		uint8_t token = *in++;
+		size_t literalLength = token >> 4;
+		if (!lzGetLength(in, inEnd, literalLength) ||
+		    literalLength > (size_t) (inEnd - in) ||
+		    literalLength > (size_t) (outEnd - out))
+		{
+			return false;
+		}
+		if ((size_t) (inEnd - in) >= literalLength + LZ_COPY_CHUNK &&
+		    (size_t) (outEnd - out) >= literalLength + LZ_COPY_CHUNK)
+		{
+			lzWildCopy(out, in, literalLength);
+		}
+		else
+		{
+			memcpy(out, in, literalLength);
+		}
+		in += literalLength;
+		out += literalLength;
+		if (in == inEnd)
+		{
+			break;
+		}
+		if (inEnd - in < 2)
+		{
+			return false;
+		}
+		size_t offset = in[0] | in[1] << 8,
+		       matchLength = token & LZ_NIBBLE_MAX;
+		in += 2;
+		if (!lzGetLength(in, inEnd, matchLength))
+		{
+			return false;
+		}
+		matchLength += LZ_MIN_MATCH;
+		if (offset == 0 || offset > (size_t) (out - (uint8_t*) dst) ||
+		    matchLength > (size_t) (outEnd - out))
+		{
+			return false;
+		}
+		const uint8_t *match = out - offset;
+		if (offset >= LZ_COPY_CHUNK &&
+		    (size_t) (outEnd - out) >= matchLength + LZ_COPY_CHUNK)
+		{
+			lzWildCopy(out, match, matchLength);
+		}
+		else if (offset >= matchLength)
+		{
+			memcpy(out, match, matchLength);
+		}
+		else
+		{
+			// Overlaps what it writes, e.g. a run of one byte
+			for (size_t i = 0; i < matchLength; ++i)
+			{
+				out[i] = match[i];
+			}
+		}
+		out += matchLength;
+	}
+	return out == outEnd;
+}
+
+/**
+ * Compress size bytes of a block's data into a new heap buffer, and
+ * return it (setting packedSize), or nullptr if it doesn't get small
+ * enough to be worth it.
+ */
+char *packData(const char *data, size_t size, size_t &packedSize)
+{
+	static thread_local std::vector<char> buffer;
+	size_t capacity = Block::size * PACK_MAX_PERCENT / 100;
+	buffer.resize(capacity);
+	packedSize = lzCompress(data, size, buffer.data(), capacity);
+	char *packed = packedSize == 0 ? nullptr : (char*) malloc(packedSize);
+	if (packed == nullptr)
+	{
+		countStat(STAT_PACK_REJECTS);
+		return nullptr;
+	}
+	memcpy(packed, buffer.data(), packedSize);
+	return packed;
+}
+
+/**
+ * Keep a clean block compressed, in packed (which packData returned for
+ * its data), and give its data buffer back to the arena.
+ */
+void setPacked(Block *block, char *packed, size_t packedSize)
+{
+	blockArena.release(block->data);
+	block->data = nullptr;
+	block->packed = packed;
+	block->packedSize = packedSize;
+	countStat(STAT_PACKED);
+}
+
+/**
+ * Give a compressed block a data buffer again, with its data. Returns
+ * false if there's no memory for it or the compressed data is corrupt, in
+ * which case the block stays compressed.
+ */
+bool unpackBlock(Block *block)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	char *data = blockArena.allocate(Block::size);
+	if (data == nullptr)
+	{
+		return false;
+	}
+	if (!lzDecompress(block->packed, block->packedSize, data,
+			  block->written))
+	{
+		blockArena.release(data);
+		return false;
+	}
+	block->data = data;
+	free(block->packed);
+	block->packed = nullptr;
+	block->packedSize = 0;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	countStat(STAT_UNPACKED);
+	countStat(STAT_UNPACK_NSEC, (end.tv_sec - start.tv_sec) *
+		  NSEC_PER_SEC + end.tv_nsec - start.tv_nsec);
+	return true;
+}
+
+/**
+ * Returns the block's data, decompressed into buffer (which has room for
+ * a block) if the block is compressed, or nullptr if its compressed data
+ * is corrupt. The block doesn't change.
+ */
+const char *unpackedData(const Block *block, char *buffer)
+{
+	if (block->packed == nullptr)
+	{
+		return block->data;
+	}
+	return lzDecompress(block->packed, block->packedSize, buffer,
+			    block->written) ? buffer : nullptr;
+}
+
+#endif
@@ -0,0 +1,196 @@
+/**
+ * The directory cache: a directory's listing is kept per directory inode,
+ * with the type and inode number of every entry, and readdir() serves it
+ * from memory for as long as the directory's mtime and ctime don't change
+ * (any change to its entries changes both). A listing is only cached once
+ * the directory wasn't changed for a while, since two changes within the
+ * same timestamp tick would look like none. When the listings have too
+ * many entries in all, the least recently used ones are dropped.
+ */
+#ifndef _DIRCACHE_H
+#define _DIRCACHE_H
+
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "Block.h"
+#include "Stats.h"
+#include "my_pthread.h"
+
+using std::string;
+using std::vector;
+
+#define DIR_CACHE_MAX_ENTRIES (1 << 20)	// Listings beyond that many entries in
+					// all evict the least recently used
+#define DIR_RACY_NSEC NSEC_PER_SEC	// Directories changed more recently
+					// aren't cached
+
+/**
+ * An entry of a listing. Its name is at nameOffset in the listing's names.
+ */
+struct DirEntry
+{
+	size_t nameOffset;
+	ino_t ino;
+	mode_t mode;	// Only the file type bits
+};
+
+/**
+ * The entries of a directory, and the times it had when they were read.
+ * Never changes once it's cached, so open directories can share it.
+ */
+struct DirListing
+{
+	struct timespec mtime, ctime;
+	string names;	// The entries' names, each followed by a '\0'
+	vector<DirEntry> entries;
+
+	DirListing(const struct stat &st) : mtime(st.st_mtim), ctime(st.st_ctim)
+	{
+	}
+
+	/**
+	 * Add an entry with the given name, inode number and dirent type.
+	 */
+	void add(const char *name, ino_t ino, unsigned char type)
+	{
+		entries.push_back(DirEntry{names.size(), ino,
+				(mode_t) DTTOIF(type)});
+		names.append(name);
+		names.push_back('\0');
+	}
+
+	/**
+	 * Returns the name of the given entry.
+	 */
+	const char *name(const DirEntry &entry) const
+	{
+		return names.c_str() + entry.nameOffset;
+	}
+};
+
+typedef std::shared_ptr<const DirListing> DirListingPtr;
+
+/**
+ * Returns true if the two times are the same.
+ */
+bool sameTime(const struct timespec &a, const struct timespec &b)
+{
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/**
+ * A cached listing, and its place in the cache's LRU list.
+ */
+struct CachedDir
+{
+	DirListingPtr listing;
+	std::list<FileId>::iterator use;
+};
+
+class DirCache
+{
+public:
+	typedef std::unordered_map<FileId, CachedDir, FileIdHash> DirMap;
+
+	pthread_mutex_t lock;	// Guards dirs, lru and entries
+	DirMap dirs;
+	std::list<FileId> lru;	// The cached directories, most recently used
+				// first
+	size_t entries;		// In all the listings
+
+	DirCache() : entries(0)
+	{
+		my_pthread_mutex_init(&lock, nullptr);
+	}
+
+	~DirCache()
+	{
+		my_pthread_mutex_destroy(&lock);
+	}
+
+	/**
+	 * Returns the cached listing of the directory with the given
+	 * attributes, or nullptr if it isn't cached or the directory changed
+	 * since it was.
+	 */
+	DirListingPtr get(const struct stat &st)
+	{
+		ScopedLock guard(&lock);
+		DirMap::iterator it = dirs.find(FileId{st.st_dev, st.st_ino});
+		if (it == dirs.end())
+		{
+			countStat(STAT_DIR_MISSES);
+			return nullptr;
+		}
+		const DirListing &listing = *it->second.listing;
+		if (!sameTime(listing.mtime, st.st_mtim) ||
+		    !sameTime(listing.ctime, st.st_ctim))
+		{
+			drop(it);
+			countStat(STAT_DIR_MISSES);
+			return nullptr;
+		}
+		lru.splice(lru.begin(), lru, it->second.use);
+		countStat(STAT_DIR_HITS);
+		return it->second.listing;
+	}
+
+	/**
+	 * Cache the listing of the directory with the given attributes,
+	 * whose times must be the ones they had before it was read, unless
+	 * the directory changed too recently to tell if it changed again.
+	 */
+	void put(const struct stat &st, const DirListingPtr &listing)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		uint64_t nowNsec = now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+		if (nowNsec < st.st_mtim.tv_sec * NSEC_PER_SEC +
+		    st.st_mtim.tv_nsec + DIR_RACY_NSEC ||
+		    nowNsec < st.st_ctim.tv_sec * NSEC_PER_SEC +
+		    st.st_ctim.tv_nsec + DIR_RACY_NSEC)
+		{
+			return;
+		}
+		size_t size = listing->entries.size();
+		if (size > DIR_CACHE_MAX_ENTRIES)
+		{
+			return;
+		}
+		FileId dir{st.st_dev, st.st_ino};
+		ScopedLock guard(&lock);
+		DirMap::iterator it = dirs.find(dir);
+		if (it != dirs.end())
+		{
+			drop(it);
+		}
+		while (entries + size > DIR_CACHE_MAX_ENTRIES)
+		{
+			drop(dirs.find(lru.back()));
+		}
+		lru.push_front(dir);
+		dirs[dir] = CachedDir{listing, lru.begin()};
+		entries += size;
+	}
+
+	/**
+	 * Drop a cached listing. Must be called with lock held.
+	 */
+	void drop(DirMap::iterator it)
+	{
+		entries -= it->second.listing->entries.size();
+		lru.erase(it->second.use);
+		dirs.erase(it);
+	}
+};
+
+static DirCache dirCache;	// The listings of the directories readdir read
+
+#endif
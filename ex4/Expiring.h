@@ -0,0 +1,145 @@
+/**
+ * A bounded map whose entries expire, for the caches of metadata that is
+ * only trusted for a timeout (attributes, missing paths). Entries are
+ * queued in the order they were added, which is also the order they
+ * expire in, since they all get the same timeout. Adding one first drops
+ * the expired entries at the front of the queue, and if the map is still
+ * full, the oldest one; an entry that was put again since it was queued
+ * gets another turn at the back instead, so entries that keep being used
+ * stay.
+ * It isn't synchronized: the cache that holds it locks it.
+ */
+#ifndef _EXPIRING_H
+#define _EXPIRING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <utility>
+
+template <typename Key, typename Value, typename Hash = std::hash<Key> >
+class ExpiringMap
+{
+public:
+	/**
+	 * A value, when it expires, and when the queue thinks it does.
+	 */
+	struct Entry
+	{
+		Value value;
+		uint64_t expires;
+		uint64_t queued;
+	};
+
+	typedef std::unordered_map<Key, Entry, Hash> Map;
+	typedef std::pair<uint64_t, Key> Queued;	// (queued, key)
+
+	Map entries;
+	std::deque<Queued> queue;	// One per entry, oldest first, and the
+					// ones of erased entries until they're
+					// reached
+	size_t capacity;
+
+	ExpiringMap(size_t maxEntries) : capacity(maxEntries)
+	{
+	}
+
+	/**
+	 * Returns the value of the key, or nullptr if it isn't in the map or
+	 * expired by now (in which case it's erased).
+	 */
+	Value *find(const Key &key, uint64_t now)
+	{
+		typename Map::iterator it = entries.find(key);
+		if (it == entries.end())
+		{
+			return nullptr;
+		}
+		if (now >= it->second.expires)
+		{
+			entries.erase(it);
+			return nullptr;
+		}
+		return &it->second.value;
+	}
+
+	/**
+	 * Set the value of the key until expires, making room for it if it's
+	 * new.
+	 */
+	void put(const Key &key, const Value &value, uint64_t expires,
+		 uint64_t now)
+	{
+		typename Map::iterator it = entries.find(key);
+		if (it != entries.end())
+		{
+			it->second.value = value;
+			it->second.expires = expires;
+			return;
+		}
+		trim(now, capacity - 1);
+		entries.insert(std::make_pair(key,
+					      Entry{value, expires, expires}));
+		queue.push_back(Queued(expires, key));
+	}
+
+	/**
+	 * Drop the entries at the front of the queue that expired by now,
+	 * and then the oldest ones while there are more than max. The queue
+	 * entries of erased entries are dropped as they're reached.
+	 */
+	void trim(uint64_t now, size_t max)
+	{
+		while (!queue.empty())
+		{
+			const Queued &front = queue.front();
+			typename Map::iterator it = entries.find(front.second);
+			if (it == entries.end() ||
+			    it->second.queued != front.first)
+			{
+				queue.pop_front();
+				continue;
+			}
+			Entry &entry = it->second;
+			if (entry.expires > now)
+			{
+				if (entries.size() <= max)
+				{
+					break;
+				}
+				if (entry.expires != entry.queued)
+				{
+					// Put again since: requeue it
+					entry.queued = entry.expires;
+					queue.push_back(Queued(entry.queued,
+							       it->first));
+					queue.pop_front();
+					continue;
+				}
+			}
+			entries.erase(it);
+			queue.pop_front();
+		}
+	}
+
+	/**
+	 * Erase the key, if it's in the map.
+	 */
+	void erase(const Key &key)
+	{
+		entries.erase(key);
+	}
+
+	/**
+	 * Erase all the entries.
+	 */
+	void clear()
+	{
+		entries.clear();
+		queue.clear();
+	}
+};
+
+#endif
@@ -0,0 +1,84 @@
+/**
+ * The table of blocks being read on demand. When several threads miss the
+ * same block at once (e.g. many processes opening the same hot file), only
+ * the first one reads it; the others wait for it to be cached and then find
+ * it there, instead of reading it again and racing to cache their copies.
+ * A thread never waits while it has blocks claimed, so there's no deadlock.
+ */
+#ifndef _INFLIGHT_H
+#define _INFLIGHT_H
+
+#include <unordered_set>
+#include "Block.h"
+#include "Stats.h"
+#include "my_pthread.h"
+
+class InFlightTable
+{
+public:
+	pthread_mutex_t lock;	// Guards blocks
+	pthread_cond_t done;	// Broadcast when blocks are released
+	std::unordered_set<BlockKey, BlockKeyHash> blocks;
+
+	InFlightTable()
+	{
+		my_pthread_mutex_init(&lock, nullptr);
+		my_pthread_cond_init(&done, nullptr);
+	}
+
+	~InFlightTable()
+	{
+		my_pthread_cond_destroy(&done);
+		my_pthread_mutex_destroy(&lock);
+	}
+
+	/**
+	 * Claim the blocks first..first+count-1 of the file for reading them,
+	 * up to the first one another thread is reading. If that's the first
+	 * one, nothing is claimed, and if wait is true this waits until its
+	 * reader is done. Returns the number of blocks claimed, which the
+	 * caller must release once they're cached (or it failed to read them).
+	 */
+	size_t claim(const FileId &file, size_t first, size_t count,
+		     bool wait = true)
+	{
+		ScopedLock guard(&lock);
+		if (blocks.count(BlockKey{file, first}) != 0)
+		{
+			if (!wait)
+			{
+				return 0;
+			}
+			countStat(STAT_MISS_WAITS);
+			do
+			{
+				my_pthread_cond_wait(&done, &lock);
+			} while (blocks.count(BlockKey{file, first}) != 0);
+			return 0;
+		}
+		size_t claimed = 0;
+		while (claimed < count &&
+		       blocks.insert(BlockKey{file, first + claimed}).second)
+		{
+			++claimed;
+		}
+		return claimed;
+	}
+
+	/**
+	 * Release blocks that claim() gave, and wake their waiters.
+	 */
+	void release(const FileId &file, size_t first, size_t count)
+	{
+		ScopedLock guard(&lock);
+		for (size_t num = first; num < first + count; ++num)
+		{
+			blocks.erase(BlockKey{file, num});
+		}
+		my_pthread_cond_broadcast(&done);
+	}
+};
+
+static InFlightTable inFlight;	// The blocks reads are reading right now
+
+#endif
@@ -0,0 +1,130 @@
+/**
+ * The negative lookup cache: getattr() of a path that doesn't exist (e.g. a
+ * compiler probing every include directory for a header) answers ENOENT
+ * from it for up to negative_timeout seconds, instead of resolving the
+ * path and calling lstat(). The same timeout is passed on to fuse, so the
+ * kernel doesn't even ask for a while. Creating a file or renaming onto a
+ * path drops the path and everything under it.
+ */
+#ifndef _NEGATIVECACHE_H
+#define _NEGATIVECACHE_H
+
+#include <cstdint>
+#include <string>
+#include "Expiring.h"
+#include "Trace.h"
+#include "Stats.h"
+#include "my_pthread.h"
+
+using std::string;
+
+#define DEF_NEGATIVE_TIMEOUT 1.0	// Seconds
+#define NEGATIVE_CACHE_MAX 16384	// Paths beyond that evict the oldest
+
+class NegativeCache
+{
+public:
+	pthread_mutex_t lock;	// Guards paths and generation
+	ExpiringMap<string, bool> paths;	// The values aren't used
+	uint64_t ttlNsec;	// 0 turns the cache off
+	uint64_t generation;	// Changes when paths are dropped
+
+	NegativeCache() : paths(NEGATIVE_CACHE_MAX),
+		ttlNsec(DEF_NEGATIVE_TIMEOUT * NSEC_PER_SEC), generation(0)
+	{
+		my_pthread_mutex_init(&lock, nullptr);
+	}
+
+	~NegativeCache()
+	{
+		my_pthread_mutex_destroy(&lock);
+	}
+
+	/**
+	 * Set how long missing paths are cached, in seconds.
+	 */
+	void configure(double timeoutSec)
+	{
+		ttlNsec = timeoutSec * NSEC_PER_SEC;
+	}
+
+	/**
+	 * Returns true if the path (relative to the mountdir) is known not to
+	 * exist. Otherwise currentGeneration is set to what put() needs.
+	 */
+	bool get(const char *path, uint64_t &currentGeneration)
+	{
+		if (ttlNsec == 0)
+		{
+			return false;
+		}
+		ScopedLock guard(&lock);
+		if (paths.find(path, monotonicNsec()) != nullptr)
+		{
+			countStat(STAT_NEGATIVE_HITS);
+			return true;
+		}
+		currentGeneration = generation;
+		return false;
+	}
+
+	/**
+	 * Remember that the path doesn't exist, unless paths were dropped
+	 * since get() gave lookupGeneration, since it may have been created
+	 * after it was looked up.
+	 */
+	void put(const char *path, uint64_t lookupGeneration)
+	{
+		if (ttlNsec == 0)
+		{
+			return;
+		}
+		countStat(STAT_NEGATIVE_MISSES);
+		ScopedLock guard(&lock);
+		if (generation != lookupGeneration)
+		{
+			return;
+		}
+		uint64_t now = monotonicNsec();
+		paths.put(path, true, now + ttlNsec, now);
+	}
+
+	/**
+	 * Drop the path after a file was created there, and if subtree is
+	 * true (something was renamed there, maybe a directory) the paths
+	 * under it too.
+	 */
+	void forget(const string &path, bool subtree = false)
+	{
+		if (ttlNsec == 0)
+		{
+			return;
+		}
+		ScopedLock guard(&lock);
+		++generation;
+		if (!subtree)
+		{
+			paths.erase(path);
+			return;
+		}
+		for (ExpiringMap<string, bool>::Map::iterator it =
+		     paths.entries.begin(); it != paths.entries.end(); )
+		{
+			const string &other = it->first;
+			if (other.compare(0, path.size(), path) == 0 &&
+			    (other.size() == path.size() ||
+			     other[path.size()] == '/'))
+			{
+				it = paths.entries.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+};
+
+static NegativeCache negativeCache;	// The paths getattr didn't find
+
+#endif
@@ -0,0 +1,254 @@
+/**
+ * The operation log: every operation logs a "time name" line to the log
+ * file. Writing (and flushing) the line in the operation itself costs a
+ * lock and a system call per operation, so operations only push a record
+ * into a lock-free ring, and a background thread writes the records to the
+ * log in batches, with one flush per batch. When the ring is full, records
+ * are dropped (and counted as log_dropped) rather than making operations
+ * wait for the disk.
+ * With -o log_level=sampled only one of every log_sample records (per
+ * thread) is kept, and -o log_level=off keeps none.
+ */
+#ifndef _OPLOG_H
+#define _OPLOG_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <ostream>
+#include "Stats.h"
+#include "my_pthread.h"
+
+#define LOG_RING_SIZE 16384	// Records, a power of 2
+#define LOG_FLUSH_MSEC 50	// How often the thread writes the records
+#define DEF_LOG_SAMPLE 100	// Keep one of that many with log_level=sampled
+#define LOG_DELIM " "
+
+/**
+ * The log levels, from -o log_level=.
+ */
+enum LogLevel
+{
+	LOG_ALL = 0,	// Log every operation (the default)
+	LOG_SAMPLED,	// Log one of every log_sample operations
+	LOG_OFF,	// Log nothing but the ioctl dumps
+	NUM_LOG_LEVELS
+};
+
+const char *logLevelName[NUM_LOG_LEVELS] = {"all", "sampled", "off"};
+
+/**
+ * Set level to the log level with the given name. Returns false if there's
+ * no such level.
+ */
+bool parseLogLevel(const char *name, LogLevel &level)
+{
+	for (int i = 0; i < NUM_LOG_LEVELS; ++i)
+	{
+		if (strcmp(name, logLevelName[i]) == 0)
+		{
+			level = (LogLevel) i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * A slot of the ring. sequence tells who may use it next: the producer of
+ * the record at position p (counting from the start of the log) may fill
+ * the slot when sequence == p, and the consumer may take it when
+ * sequence == p + 1.
+ */
+struct LogRecord
+{
+	std::atomic<uint64_t> sequence;
+	time_t time;
+	const char *name;	// A string literal, never freed
+};
+
+class OpLog
+{
+public:
+	LogRecord ring[LOG_RING_SIZE];
+	std::atomic<uint64_t> head;	// The position of the next push
+	uint64_t tail;		// The position of the next pop, under outLock
+	std::ostream *out;	// The log file
+	pthread_mutex_t *outLock;	// Guards out and tail
+	LogLevel level;
+	unsigned int sample;
+	pthread_t thread;
+	pthread_mutex_t lock;	// Guards running
+	pthread_cond_t wake;	// Signalled when the ring fills up, or on stop
+	bool running;
+
+	OpLog() : head(0), tail(0), out(nullptr), outLock(nullptr),
+		level(LOG_ALL), sample(DEF_LOG_SAMPLE), running(false)
+	{
+		for (uint64_t i = 0; i < LOG_RING_SIZE; ++i)
+		{
+			ring[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		my_pthread_mutex_init(&lock, nullptr);
+		my_pthread_cond_init(&wake, nullptr);
+	}
+
+	~OpLog()
+	{
+		stop();
+		my_pthread_cond_destroy(&wake);
+		my_pthread_mutex_destroy(&lock);
+	}
+
+	/**
+	 * Set the log level, and which records are kept when sampling.
+	 */
+	void configure(LogLevel logLevel, unsigned int logSample)
+	{
+		level = logLevel;
+		sample = logSample == 0 ? 1 : logSample;
+	}
+
+	/**
+	 * Start writing the records to the given stream, which may only be
+	 * written while holding streamLock.
+	 */
+	void start(std::ostream &stream, pthread_mutex_t *streamLock)
+	{
+		ScopedLock guard(&lock);
+		out = &stream;
+		outLock = streamLock;
+		if (!running)
+		{
+			running = true;
+			my_pthread_create(&thread, nullptr, OpLog::run, this);
+		}
+	}
+
+	/**
+	 * Stop the thread, and write the records that are left.
+	 */
+	void stop()
+	{
+		{
+			ScopedLock guard(&lock);
+			if (!running)
+			{
+				return;
+			}
+			running = false;
+			my_pthread_cond_signal(&wake);
+		}
+		my_pthread_join(thread, nullptr);
+		ScopedLock guard(outLock);
+		drain();
+	}
+
+	/**
+	 * Log the operation with the given name (a string literal), unless
+	 * the level says otherwise or the ring is full. Never blocks.
+	 */
+	void push(const char *name)
+	{
+		static thread_local unsigned int skipped = 0;
+		if (level == LOG_OFF ||
+		    (level == LOG_SAMPLED && ++skipped % sample != 0))
+		{
+			return;
+		}
+		uint64_t pos = head.load(std::memory_order_relaxed);
+		LogRecord *record;
+		while (true)
+		{
+			record = &ring[pos % LOG_RING_SIZE];
+			int64_t diff = (int64_t) (record->sequence.load(
+				std::memory_order_acquire) - pos);
+			if (diff == 0)
+			{
+				if (head.compare_exchange_weak(pos, pos + 1,
+						std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (diff < 0)
+			{
+				// Still holds a record from a lap ago
+				countStat(STAT_LOG_DROPPED);
+				return;
+			}
+			else
+			{
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+		record->time = time(nullptr);
+		record->name = name;
+		record->sequence.store(pos + 1, std::memory_order_release);
+		if (pos % (LOG_RING_SIZE / 2) == 0)
+		{
+			// Don't wait for the timer with half the ring full
+			my_pthread_cond_signal(&wake);
+		}
+	}
+
+	/**
+	 * Write all the records that were pushed (and are complete) to the
+	 * log. Must be called with outLock held, so anything written to the
+	 * log after it comes after the records.
+	 */
+	void drain()
+	{
+		if (out == nullptr)
+		{
+			return;
+		}
+		while (true)
+		{
+			LogRecord &record = ring[tail % LOG_RING_SIZE];
+			if (record.sequence.load(std::memory_order_acquire) !=
+			    tail + 1)
+			{
+				break;
+			}
+			*out << record.time << LOG_DELIM << record.name << '\n';
+			record.sequence.store(tail + LOG_RING_SIZE,
+					      std::memory_order_release);
+			++tail;
+		}
+		out->flush();
+	}
+
+	/**
+	 * The thread's main loop: write the records every LOG_FLUSH_MSEC, or
+	 * sooner if the ring fills up.
+	 */
+	static void *run(void *arg)
+	{
+		OpLog *self = (OpLog*) arg;
+		ScopedLock guard(&self->lock);
+		while (self->running)
+		{
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			uint64_t nsec = until.tv_nsec + LOG_FLUSH_MSEC *
+				(NSEC_PER_SEC / 1000);
+			until.tv_sec += nsec / NSEC_PER_SEC;
+			until.tv_nsec = nsec % NSEC_PER_SEC;
+			my_pthread_cond_timedwait(&self->wake, &self->lock,
+						  &until);
+			my_pthread_mutex_unlock(&self->lock);
+			{
+				ScopedLock outGuard(self->outLock);
+				self->drain();
+			}
+			my_pthread_mutex_lock(&self->lock);
+		}
+		return nullptr;
+	}
+};
+
+static OpLog opLog;	// The operations, on their way to the log
+
+#endif
@@ -0,0 +1,160 @@
+/**
+ * The packer: a thread that compresses the blocks that cooled down (-o
+ * compress, see CacheShard::settle), so neither the miss that cooled them
+ * nor the other threads of the shard wait for the codec. The block's data
+ * is copied under the shard lock and compressed without it, and the
+ * compressed copy replaces the data only if the block is still cached,
+ * packable and holds the same data, since it may have been written to (or
+ * evicted and read again) meanwhile.
+ */
+#ifndef _PACKER_H
+#define _PACKER_H
+
+#include <deque>
+#include <vector>
+#include "Cache.h"
+#include "Compress.h"
+#include "my_pthread.h"
+
+#define PACK_QUEUE_MAX 1024	// Cooled blocks beyond that stay uncompressed
+
+class Packer
+{
+public:
+	pthread_t thread;
+	pthread_mutex_t lock;	// Guards the members below
+	pthread_cond_t cond;	// Signalled when queue or running change
+	std::deque<BlockKey> queue;	// The blocks to compress, oldest first
+	bool running;
+
+	Packer() : running(false)
+	{
+		my_pthread_mutex_init(&lock, nullptr);
+		my_pthread_cond_init(&cond, nullptr);
+	}
+
+	~Packer()
+	{
+		stop();
+		my_pthread_cond_destroy(&cond);
+		my_pthread_mutex_destroy(&lock);
+	}
+
+	/**
+	 * Start the packer thread.
+	 */
+	void start()
+	{
+		ScopedLock guard(&lock);
+		if (!running)
+		{
+			running = true;
+			my_pthread_create(&thread, nullptr, Packer::run, this);
+		}
+	}
+
+	/**
+	 * Stop the packer thread and drop the blocks it didn't compress.
+	 */
+	void stop()
+	{
+		{
+			ScopedLock guard(&lock);
+			if (!running)
+			{
+				return;
+			}
+			running = false;
+			my_pthread_cond_signal(&cond);
+		}
+		my_pthread_join(thread, nullptr);
+		queue.clear();
+	}
+
+	/**
+	 * Queue a block to be compressed, unless the thread isn't running or
+	 * is too far behind.
+	 */
+	void push(const BlockKey &key)
+	{
+		ScopedLock guard(&lock);
+		if (!running || queue.size() >= PACK_QUEUE_MAX)
+		{
+			return;
+		}
+		queue.push_back(key);
+		my_pthread_cond_signal(&cond);
+	}
+
+	/**
+	 * Compress the block, if it's still cached and packable. copy has
+	 * room for a block.
+	 */
+	static void pack(const BlockKey &key, vector<char> &copy)
+	{
+		CacheShard &shard = shardOf(key.file, key.number);
+		size_t written;
+		{
+			ScopedLock guard(&shard.lock);
+			Block *block = shard.peek(key.file, key.number);
+			if (block == nullptr || !shard.packable(block))
+			{
+				return;
+			}
+			written = block->written;
+			memcpy(copy.data(), block->data, written);
+		}
+		size_t packedSize;
+		char *packed = packData(copy.data(), written, packedSize);
+		if (packed == nullptr)
+		{
+			return;
+		}
+		ScopedLock guard(&shard.lock);
+		Block *block = shard.peek(key.file, key.number);
+		if (block == nullptr || !shard.packable(block) ||
+		    block->written != written ||
+		    memcmp(block->data, copy.data(), written) != 0)
+		{
+			free(packed);
+			return;
+		}
+		shard.pack(block, packed, packedSize);
+	}
+
+	/**
+	 * The packer thread's main loop.
+	 */
+	static void *run(void *arg)
+	{
+		Packer *self = (Packer*) arg;
+		vector<char> copy(Block::size);
+		ScopedLock guard(&self->lock);
+		while (self->running)
+		{
+			if (self->queue.empty())
+			{
+				my_pthread_cond_wait(&self->cond, &self->lock);
+				continue;
+			}
+			BlockKey key = self->queue.front();
+			self->queue.pop_front();
+			my_pthread_mutex_unlock(&self->lock);
+			pack(key, copy);
+			my_pthread_mutex_lock(&self->lock);
+		}
+		return nullptr;
+	}
+};
+
+static Packer packer;	// Compresses the cooled blocks of all the shards
+
+/**
+ * The cache's packCooledBlock hook.
+ */
+void packLater(const Block *block)
+{
+	packer.push(block->key());
+}
+
+#endif
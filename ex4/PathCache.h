@@ -0,0 +1,137 @@
+/**
+ * The path cache: every operation resolves its path in the mountdir to the
+ * path of the file in the rootdir with realpath(), which lstat()s every
+ * component of the path. The resolved paths are cached, so a path is only
+ * resolved once, no matter how deep it is, until a rename (which may move
+ * any directory a cached path goes through) drops them all.
+ * Only paths that exist are cached; changes made to the rootdir behind the
+ * filesystem's back aren't noticed.
+ * It holds up to PATH_CACHE_MAX paths, and evicts with CLOCK: a hit only
+ * marks the path as referenced, and a new path replaces the first one the
+ * clock hand finds unreferenced (clearing the marks it passes), so a walk
+ * over more paths than that keeps the ones that are used again.
+ */
+#ifndef _PATHCACHE_H
+#define _PATHCACHE_H
+
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "Stats.h"
+#include "my_pthread.h"
+
+using std::string;
+
+#define PATH_CACHE_MAX 4096	// Paths beyond that evict others
+
+/**
+ * A resolved path, and whether it was used since the clock hand passed.
+ */
+struct CachedPath
+{
+	string resolved;
+	bool referenced;
+};
+
+typedef std::unordered_map<string, CachedPath> PathMap;
+
+class PathCache
+{
+public:
+	pthread_mutex_t lock;	// Guards the members below
+	PathMap paths;		// Mountdir -> rootdir
+	std::vector<PathMap::value_type*> clock;	// The paths' entries,
+							// which never move
+	size_t hand;		// The next one the clock looks at
+	uint64_t generation;	// Changes when the paths are dropped
+
+	PathCache() : hand(0), generation(0)
+	{
+		my_pthread_mutex_init(&lock, nullptr);
+	}
+
+	~PathCache()
+	{
+		my_pthread_mutex_destroy(&lock);
+	}
+
+	/**
+	 * Copy the resolved path of the given path (in the mountdir) to
+	 * resolved. Returns false if it isn't cached, in which case
+	 * currentGeneration is set to what put() needs.
+	 */
+	bool get(const char *path, char resolved[PATH_MAX],
+		 uint64_t &currentGeneration)
+	{
+		ScopedLock guard(&lock);
+		PathMap::iterator it = paths.find(path);
+		if (it == paths.end())
+		{
+			currentGeneration = generation;
+			countStat(STAT_PATH_MISSES);
+			return false;
+		}
+		const string &found = it->second.resolved;
+		memcpy(resolved, found.c_str(), found.size() + 1);
+		it->second.referenced = true;
+		countStat(STAT_PATH_HITS);
+		return true;
+	}
+
+	/**
+	 * Cache the resolved path of the given path, unless the paths were
+	 * dropped since get() missed it (and gave resolvedGeneration), since
+	 * it may have been resolved before a rename.
+	 */
+	void put(const char *path, const char *resolved,
+		 uint64_t resolvedGeneration)
+	{
+		ScopedLock guard(&lock);
+		if (generation != resolvedGeneration)
+		{
+			return;
+		}
+		std::pair<PathMap::iterator, bool> added =
+			paths.insert(std::make_pair(string(path),
+						    CachedPath{resolved, false}));
+		if (!added.second)
+		{
+			added.first->second.resolved = resolved;
+			return;
+		}
+		if (clock.size() < PATH_CACHE_MAX)
+		{
+			clock.push_back(&*added.first);
+			return;
+		}
+		// Give the slot of the first unreferenced path to the new one
+		while (clock[hand]->second.referenced)
+		{
+			clock[hand]->second.referenced = false;
+			hand = (hand + 1) % clock.size();
+		}
+		paths.erase(clock[hand]->first);
+		clock[hand] = &*added.first;
+		hand = (hand + 1) % clock.size();
+	}
+
+	/**
+	 * Drop all the cached paths.
+	 */
+	void clear()
+	{
+		ScopedLock guard(&lock);
+		paths.clear();
+		clock.clear();
+		hand = 0;
+		++generation;
+	}
+};
+
+static PathCache pathCache;	// The resolved paths of the operations
+
+#endif
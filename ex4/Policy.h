@@ -0,0 +1,1255 @@
+#ifndef _POLICY_H
+#define _POLICY_H
+
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+#include "Block.h"
+
+#define POLICY_FBR "fbr"
+#define POLICY_ADAPTIVE_FBR "afbr"
+#define POLICY_LRU "lru"
+#define POLICY_LFU "lfu"
+#define POLICY_2Q "2q"
+#define POLICY_ARC "arc"
+#define POLICY_CLOCK_PRO "clockpro"
+#define DEF_POLICY POLICY_FBR
+
+/**
+ * A cache replacement policy. The cache shard holds the blocks and their
+ * index, and tells the policy about every block that enters the cache, is
+ * referenced, or leaves it for other reasons than eviction. The policy
+ * decides which block to evict when the cache is full.
+ * Policies keep their bookkeeping in the blocks' links, bucket, queue and
+ * policyEntry fields, and may remember evicted blocks (ghosts) by key.
+ */
+class CachePolicy
+{
+public:
+	size_t capacity;	// The number of blocks the cache may hold
+	bool reportCooled;	// Whether to collect cooled blocks
+	std::vector<Block*> cooled;	// Blocks that left the policy's hot
+					// part (FBR's new section), which the
+					// shard takes after every operation
+
+	CachePolicy(size_t blocks) : capacity(blocks), reportCooled(false)
+	{
+	}
+
+	virtual ~CachePolicy()
+	{
+	}
+
+	/**
+	 * Returns the name the policy is selected by.
+	 */
+	virtual const char *name() const = 0;
+
+	/**
+	 * A block was just read into the cache. If the cache is full, the
+	 * policy evicts a block (never the new one) and returns it, so the
+	 * shard can free it. Otherwise returns nullptr.
+	 */
+	virtual Block *insert(Block *block) = 0;
+
+	/**
+	 * Returns the block insert() would evict if the cache were full, or
+	 * nullptr if the policy only decides that while inserting (like the
+	 * ones that consult their ghosts), in which case the admission filter
+	 * lets every block in.
+	 */
+	virtual Block *victim() const
+	{
+		return nullptr;
+	}
+
+	/**
+	 * A cached block was referenced.
+	 */
+	virtual void hit(Block *block) = 0;
+
+	/**
+	 * A cached block leaves the cache without being evicted.
+	 */
+	virtual void remove(Block *block) = 0;
+
+	/**
+	 * Call func on every cached block, roughly from the next eviction
+	 * victim to the block that would be evicted last.
+	 */
+	virtual void forEach(const std::function<void(Block&)> &func) = 0;
+
+	/**
+	 * Forget all the blocks and the history. The blocks aren't freed.
+	 */
+	virtual void clear() = 0;
+};
+
+/* ========== Helper Structures ========== */
+
+/**
+ * Blocks bucketed by their refCount, each bucket ordered by recency, using
+ * the given links of the blocks. A block's refCount must not change while
+ * it's in a bucket.
+ */
+class FrequencyBuckets
+{
+public:
+	std::map<size_t, BlockList> buckets;
+	BlockLinks Block::*links;
+
+	FrequencyBuckets(BlockLinks Block::*blockLinks) : links(blockLinks)
+	{
+	}
+
+	/**
+	 * Link the block into the bucket of its refCount, at its MRU end if
+	 * atFront is true and at its LRU end otherwise.
+	 */
+	void link(Block *block, bool atFront)
+	{
+		std::map<size_t, BlockList>::iterator it =
+			buckets.find(block->refCount);
+		if (it == buckets.end())
+		{
+			it = buckets.insert(std::make_pair(block->refCount,
+					BlockList(links))).first;
+		}
+		if (atFront)
+		{
+			it->second.pushFront(block);
+		}
+		else
+		{
+			it->second.pushBack(block);
+		}
+	}
+
+	/**
+	 * Unlink the block from its bucket. Empty buckets are dropped.
+	 */
+	void unlink(Block *block)
+	{
+		std::map<size_t, BlockList>::iterator it =
+			buckets.find(block->refCount);
+		it->second.remove(block);
+		if (it->second.count == 0)
+		{
+			buckets.erase(it);
+		}
+	}
+
+	/**
+	 * Returns the LRU block of the lowest refCount, or nullptr if there
+	 * are no blocks. This is O(log(number of distinct refCounts)).
+	 */
+	Block *lowest() const
+	{
+		return buckets.empty() ? nullptr : buckets.begin()->second.tail;
+	}
+
+	/**
+	 * Call func on every block, from the lowest refCount to the highest,
+	 * LRU first.
+	 */
+	void forEach(const std::function<void(Block&)> &func) const
+	{
+		for (const std::pair<const size_t, BlockList> &bucket : buckets)
+		{
+			for (Block *block = bucket.second.tail;
+			     block != nullptr;
+			     block = bucket.second.prev(block))
+			{
+				func(*block);
+			}
+		}
+	}
+};
+
+/**
+ * A FIFO of the keys of evicted blocks, with an index for lookups.
+ */
+class GhostList
+{
+public:
+	typedef std::list<BlockKey> Ghosts;
+
+	Ghosts ghosts;		// From the newest to the oldest
+	std::unordered_map<BlockKey, Ghosts::iterator, BlockKeyHash> index;
+
+	size_t size() const
+	{
+		return ghosts.size();
+	}
+
+	/**
+	 * Remember the given (evicted) block as the newest ghost.
+	 */
+	void push(const Block *block)
+	{
+		ghosts.push_front(block->key());
+		index[block->key()] = ghosts.begin();
+	}
+
+	/**
+	 * If the given block has a ghost, forget it and return true.
+	 */
+	bool take(const Block *block)
+	{
+		auto it = index.find(block->key());
+		if (it == index.end())
+		{
+			return false;
+		}
+		ghosts.erase(it->second);
+		index.erase(it);
+		return true;
+	}
+
+	/**
+	 * Forget the oldest ghost, if any.
+	 */
+	void popOldest()
+	{
+		if (ghosts.empty())
+		{
+			return;
+		}
+		index.erase(ghosts.back());
+		ghosts.pop_back();
+	}
+
+	void clear()
+	{
+		index.clear();
+		ghosts.clear();
+	}
+};
+
+/* ========== FBR ========== */
+
+/**
+ * The FBR sections a cached block can be in. The new section holds the
+ * newIdx most recently used blocks, the old section holds every block
+ * from the oldIdx position (counting from the MRU) onwards, and the middle
+ * section holds whatever is in between. The boundaries are for a cache of
+ * nominal blocks; one that holds more (compressed, see -o compress) moves
+ * them in proportion, so fNew and fOld stay fractions of the blocks it
+ * holds.
+ */
+enum Section
+{
+	NEW_SECTION = 0,
+	MID_SECTION,
+	OLD_SECTION,
+	NUM_SECTIONS
+};
+
+/**
+ * Frequency based replacement. The blocks are kept in one recency list per
+ * section, and a hit outside of the new section increases the block's
+ * refCount. The victim is the block with the least refCount in the old
+ * section, LRU first. The old section blocks are also kept in frequency
+ * buckets, so the victim is simply the LRU block of the lowest bucket.
+ */
+class FbrPolicy : public CachePolicy
+{
+public:
+	size_t newIdx, oldIdx;		// The section boundaries
+	size_t nominal;			// The cache size they are for
+	BlockList sections[NUM_SECTIONS];// The recency list of each section
+	FrequencyBuckets oldBuckets;	// The old section, by refCount
+	size_t count;			// Number of blocks in all sections
+
+	FbrPolicy(size_t blocks, size_t newBlocks, size_t oldStart,
+		  size_t nominalBlocks) :
+		CachePolicy(blocks), newIdx(newBlocks), oldIdx(oldStart),
+		nominal(nominalBlocks), oldBuckets(&Block::bucket), count(0)
+	{
+	}
+
+	const char *name() const
+	{
+		return POLICY_FBR;
+	}
+
+	/**
+	 * Returns the maximal number of blocks each section may hold. The
+	 * old section takes whatever the first two leave.
+	 */
+	size_t sectionCapacity(Section section) const
+	{
+		size_t held = std::max(count, nominal);
+		switch (section)
+		{
+		case NEW_SECTION:
+			return newIdx * held / nominal;
+		case MID_SECTION:
+			return oldIdx * held / nominal - newIdx * held / nominal;
+		default:
+			return capacity;
+		}
+	}
+
+	/**
+	 * Link the block into the given section, at its MRU end if atFront
+	 * is true and at its LRU end otherwise. Blocks entering the old
+	 * section are also linked into their frequency bucket, at the same
+	 * end, so every bucket stays ordered by recency.
+	 */
+	void linkToSection(Block *block, Section section, bool atFront)
+	{
+		block->queue = section;
+		if (atFront)
+		{
+			sections[section].pushFront(block);
+		}
+		else
+		{
+			sections[section].pushBack(block);
+		}
+		if (section == OLD_SECTION)
+		{
+			oldBuckets.link(block, atFront);
+		}
+		++count;
+	}
+
+	/**
+	 * Unlink the block from its section (and its frequency bucket, if
+	 * it's in the old section).
+	 */
+	void unlinkFromSection(Block *block)
+	{
+		sections[block->queue].remove(block);
+		if (block->queue == OLD_SECTION)
+		{
+			oldBuckets.unlink(block);
+		}
+		--count;
+	}
+
+	/**
+	 * Keep the sections matching the logical positions of their blocks:
+	 * when a section is over its capacity, its LRU block moves to the
+	 * MRU end of the next section, and when it's under its capacity
+	 * (after a block was removed) it takes the MRU block of the following
+	 * sections. This is O(1), since every cache operation moves at most
+	 * one block in or out.
+	 */
+	void rebalance()
+	{
+		Block *block;
+		for (int s = NEW_SECTION; s < OLD_SECTION; ++s)
+		{
+			while (sections[s].count > sectionCapacity((Section) s))
+			{
+				block = sections[s].tail;
+				unlinkFromSection(block);
+				linkToSection(block, (Section) (s + 1), true);
+				if (s == NEW_SECTION && reportCooled)
+				{
+					cooled.push_back(block);
+				}
+			}
+		}
+		for (int s = NEW_SECTION; s < OLD_SECTION; ++s)
+		{
+			for (int t = s + 1; t < NUM_SECTIONS; ++t)
+			{
+				while (sections[s].count <
+				       sectionCapacity((Section) s) &&
+				       (block = sections[t].head) != nullptr)
+				{
+					unlinkFromSection(block);
+					linkToSection(block, (Section) s,
+						      false);
+				}
+			}
+		}
+	}
+
+	/**
+	 * Choose the block that has the least refcount in the old partition,
+	 * if two blocks are identicals in terms of refCount, the LRU one.
+	 */
+	Block *victim() const
+	{
+		Block *block = oldBuckets.lowest();
+		// Only when the old section is empty, i.e. never when full
+		for (int s = OLD_SECTION; block == nullptr && s >= NEW_SECTION;
+		     --s)
+		{
+			block = sections[s].tail;
+		}
+		return block;
+	}
+
+	Block *insert(Block *block)
+	{
+		Block *evicted = nullptr;
+		if (count >= capacity && (evicted = victim()) != nullptr)
+		{
+			unlinkFromSection(evicted);
+		}
+		linkToSection(block, NEW_SECTION, true);
+		rebalance();
+		return evicted;
+	}
+
+	void hit(Block *block)
+	{
+		// Unlink first, the refCount is the key of its bucket
+		unlinkFromSection(block);
+		if (block->queue != NEW_SECTION)
+		{
+			++block->refCount;
+		}
+		linkToSection(block, NEW_SECTION, true);
+		rebalance();
+	}
+
+	void remove(Block *block)
+	{
+		unlinkFromSection(block);
+		rebalance();
+	}
+
+	void forEach(const std::function<void(Block&)> &func)
+	{
+		for (int s = OLD_SECTION; s >= NEW_SECTION; --s)
+		{
+			for (Block *block = sections[s].tail; block != nullptr;
+			     block = sections[s].prev(block))
+			{
+				func(*block);
+			}
+		}
+	}
+
+	void clear()
+	{
+		for (int s = NEW_SECTION; s < NUM_SECTIONS; ++s)
+		{
+			sections[s] = BlockList();
+		}
+		oldBuckets.buckets.clear();
+		count = 0;
+	}
+};
+
+/* ========== Adaptive FBR ========== */
+
+/**
+ * FBR that tunes its own section sizes, in the spirit of ARC. The keys of
+ * evicted blocks are remembered in two ghost lists, by whether their
+ * refCount was ever increased. A miss on a block that was evicted without
+ * being referenced again would have hit with a larger new section (and so
+ * a smaller old one, whose victims are chosen more by recency), so the new
+ * section grows. A miss on a block that was evicted despite its references
+ * would have hit with a larger old section (whose victims are chosen more
+ * by frequency), so the old section grows. Like in ARC, the boundary moves
+ * by the ratio of the other ghost list's size to the hit one's.
+ * The middle section keeps its size, and the fNew/fOld given at mount time
+ * are only where the boundaries start.
+ */
+class AdaptiveFbrPolicy : public FbrPolicy
+{
+public:
+	GhostList onceGhosts;	// Evicted with the default refCount
+	GhostList reusedGhosts;	// Evicted with a higher refCount
+	size_t middle;		// The middle section's size
+
+	AdaptiveFbrPolicy(size_t blocks, size_t newBlocks, size_t oldStart,
+			  size_t nominalBlocks) :
+		FbrPolicy(blocks, newBlocks, oldStart, nominalBlocks),
+		middle(oldStart - newBlocks)
+	{
+	}
+
+	const char *name() const
+	{
+		return POLICY_ADAPTIVE_FBR;
+	}
+
+	/**
+	 * Grow the new section by the given number of blocks at the old
+	 * section's expense if grow is true, and the other way around
+	 * otherwise. Both sections keep at least one block.
+	 */
+	void shift(size_t delta, bool grow)
+	{
+		if (nominal < middle + 2)
+		{
+			return;
+		}
+		size_t maxNew = nominal - middle - 1;
+		newIdx = grow ? std::min(newIdx + delta, maxNew) :
+			std::max(newIdx, delta + 1) - delta;
+		oldIdx = newIdx + middle;
+	}
+
+	Block *insert(Block *block)
+	{
+		size_t once = std::max(onceGhosts.size(), (size_t) 1),
+		       reused = std::max(reusedGhosts.size(), (size_t) 1);
+		if (onceGhosts.take(block))
+		{
+			shift(std::max(reused / once, (size_t) 1), true);
+		}
+		else if (reusedGhosts.take(block))
+		{
+			shift(std::max(once / reused, (size_t) 1), false);
+		}
+		// Moves the blocks across the boundaries that moved, too
+		Block *evicted = FbrPolicy::insert(block);
+		if (evicted != nullptr)
+		{
+			if (evicted->refCount > DEF_REF_COUNT)
+			{
+				reusedGhosts.push(evicted);
+			}
+			else
+			{
+				onceGhosts.push(evicted);
+			}
+			// Remember as many evicted blocks as the cache holds
+			if (onceGhosts.size() + reusedGhosts.size() > capacity)
+			{
+				if (onceGhosts.size() > reusedGhosts.size())
+				{
+					onceGhosts.popOldest();
+				}
+				else
+				{
+					reusedGhosts.popOldest();
+				}
+			}
+		}
+		return evicted;
+	}
+
+	void clear()
+	{
+		FbrPolicy::clear();
+		onceGhosts.clear();
+		reusedGhosts.clear();
+	}
+};
+
+/* ========== LRU ========== */
+
+/**
+ * Least recently used: a single recency list, the LRU block is evicted.
+ */
+class LruPolicy : public CachePolicy
+{
+public:
+	BlockList blocks;	// From the MRU block to the LRU one
+
+	LruPolicy(size_t capacity) : CachePolicy(capacity)
+	{
+	}
+
+	const char *name() const
+	{
+		return POLICY_LRU;
+	}
+
+	Block *victim() const
+	{
+		return blocks.tail;
+	}
+
+	Block *insert(Block *block)
+	{
+		Block *evicted = nullptr;
+		if (blocks.count >= capacity)
+		{
+			evicted = blocks.popBack();
+		}
+		blocks.pushFront(block);
+		return evicted;
+	}
+
+	void hit(Block *block)
+	{
+		++block->refCount;
+		blocks.remove(block);
+		blocks.pushFront(block);
+	}
+
+	void remove(Block *block)
+	{
+		blocks.remove(block);
+	}
+
+	void forEach(const std::function<void(Block&)> &func)
+	{
+		for (Block *block = blocks.tail; block != nullptr;
+		     block = blocks.prev(block))
+		{
+			func(*block);
+		}
+	}
+
+	void clear()
+	{
+		blocks = BlockList();
+	}
+};
+
+/* ========== LFU ========== */
+
+/**
+ * Least frequently used: every hit increases the refCount, and the block
+ * with the least refCount is evicted, LRU first.
+ */
+class LfuPolicy : public CachePolicy
+{
+public:
+	FrequencyBuckets blocks;
+	size_t count;
+
+	LfuPolicy(size_t capacity) : CachePolicy(capacity),
+		blocks(&Block::links), count(0)
+	{
+	}
+
+	const char *name() const
+	{
+		return POLICY_LFU;
+	}
+
+	Block *victim() const
+	{
+		return blocks.lowest();
+	}
+
+	Block *insert(Block *block)
+	{
+		Block *evicted = nullptr;
+		if (count >= capacity &&
+		    (evicted = blocks.lowest()) != nullptr)
+		{
+			remove(evicted);
+		}
+		blocks.link(block, true);
+		++count;
+		return evicted;
+	}
+
+	void hit(Block *block)
+	{
+		blocks.unlink(block);
+		++block->refCount;
+		blocks.link(block, true);
+	}
+
+	void remove(Block *block)
+	{
+		blocks.unlink(block);
+		--count;
+	}
+
+	void forEach(const std::function<void(Block&)> &func)
+	{
+		blocks.forEach(func);
+	}
+
+	void clear()
+	{
+		blocks.buckets.clear();
+		count = 0;
+	}
+};
+
+/* ========== 2Q ========== */
+
+#define TWO_Q_IN_SHARE 4	// A1in holds 1/4 of the cache
+#define TWO_Q_OUT_SHARE 2	// A1out remembers 1/2 of the cache
+
+/**
+ * The full 2Q algorithm (Johnson & Shasha). New blocks enter the A1in
+ * FIFO, where hits don't move them. Blocks evicted from A1in are
+ * remembered in the A1out ghost FIFO, and a miss on a remembered block
+ * puts it in Am, an LRU list of the blocks that proved to be reused.
+ */
+class TwoQPolicy : public CachePolicy
+{
+public:
+	enum Queue
+	{
+		A1_IN = 0,
+		A_M
+	};
+
+	BlockList a1in, am;	// From the newest / MRU block
+	GhostList a1out;
+	size_t kin, kout;	// The sizes of A1in and A1out
+
+	TwoQPolicy(size_t capacity) : CachePolicy(capacity),
+		kin(std::max((size_t) 1, capacity / TWO_Q_IN_SHARE)),
+		kout(std::max((size_t) 1, capacity / TWO_Q_OUT_SHARE))
+	{
+	}
+
+	const char *name() const
+	{
+		return POLICY_2Q;
+	}
+
+	/**
+	 * Evict a block: from A1in if it's over its size (remembering it in
+	 * A1out), or the LRU block of Am otherwise.
+	 */
+	Block *reclaim()
+	{
+		Block *evicted;
+		if (a1in.count > kin || am.count == 0)
+		{
+			evicted = a1in.popBack();
+			a1out.push(evicted);
+			if (a1out.size() > kout)
+			{
+				a1out.popOldest();
+			}
+		}
+		else
+		{
+			evicted = am.popBack();
+		}
+		return evicted;
+	}
+
+	Block *insert(Block *block)
+	{
+		Block *evicted = nullptr;
+		if (a1in.count + am.count >= capacity)
+		{
+			evicted = reclaim();
+		}
+		if (a1out.take(block))
+		{
+			block->queue = A_M;
+			am.pushFront(block);
+		}
+		else
+		{
+			block->queue = A1_IN;
+			a1in.pushFront(block);
+		}
+		return evicted;
+	}
+
+	void hit(Block *block)
+	{
+		++block->refCount;
+		if (block->queue == A_M)
+		{
+			am.remove(block);
+			am.pushFront(block);
+		}
+	}
+
+	void remove(Block *block)
+	{
+		(block->queue == A_M ? am : a1in).remove(block);
+	}
+
+	void forEach(const std::function<void(Block&)> &func)
+	{
+		for (BlockList *list : {&a1in, &am})
+		{
+			for (Block *block = list->tail; block != nullptr;
+			     block = list->prev(block))
+			{
+				func(*block);
+			}
+		}
+	}
+
+	void clear()
+	{
+		a1in = BlockList();
+		am = BlockList();
+		a1out.clear();
+	}
+};
+
+/* ========== ARC ========== */
+
+/**
+ * Adaptive replacement cache (Megiddo & Modha). T1 holds blocks that were
+ * referenced once recently and T2 blocks that were referenced at least
+ * twice. B1 and B2 remember the blocks evicted from T1 and T2, and a miss
+ * on a remembered block moves the target size of T1 (p) towards the list
+ * that would have kept it.
+ */
+class ArcPolicy : public CachePolicy
+{
+public:
+	enum Queue
+	{
+		T1 = 0,
+		T2
+	};
+
+	BlockList t1, t2;	// From the MRU block to the LRU one
+	GhostList b1, b2;
+	size_t p;		// The target size of T1
+
+	ArcPolicy(size_t capacity) : CachePolicy(capacity), p(0)
+	{
+	}
+
+	const char *name() const
+	{
+		return POLICY_ARC;
+	}
+
+	/**
+	 * Evict the LRU block of T1 or of T2, according to p, and remember
+	 * it in B1 or B2.
+	 */
+	Block *replace(bool inB2)
+	{
+		Block *evicted;
+		if (t1.count > 0 &&
+		    (t1.count > p || (inB2 && t1.count == p) ||
+		     t2.count == 0))
+		{
+			evicted = t1.popBack();
+			b1.push(evicted);
+		}
+		else
+		{
+			evicted = t2.popBack();
+			b2.push(evicted);
+		}
+		return evicted;
+	}
+
+	Block *insert(Block *block)
+	{
+		Block *evicted = nullptr;
+		bool full = t1.count + t2.count >= capacity;
+		size_t b1Size = b1.size(), b2Size = b2.size();
+		if (b1.take(block))
+		{
+			p = std::min(capacity,
+				     p + std::max(b2Size / b1Size, (size_t) 1));
+			evicted = full ? replace(false) : nullptr;
+			block->queue = T2;
+			t2.pushFront(block);
+			return evicted;
+		}
+		if (b2.take(block))
+		{
+			p -= std::min(p, std::max(b1Size / b2Size, (size_t) 1));
+			evicted = full ? replace(true) : nullptr;
+			block->queue = T2;
+			t2.pushFront(block);
+			return evicted;
+		}
+
+		// A block ARC doesn't remember
+		if (t1.count + b1Size >= capacity)
+		{
+			if (t1.count < capacity)
+			{
+				b1.popOldest();
+				evicted = full ? replace(false) : nullptr;
+			}
+			else
+			{
+				// T1 is the whole cache, drop its LRU block
+				evicted = t1.popBack();
+			}
+		}
+		else
+		{
+			if (t1.count + t2.count + b1Size + b2Size >=
+			    2 * capacity)
+			{
+				b2.popOldest();
+			}
+			evicted = full ? replace(false) : nullptr;
+		}
+		block->queue = T1;
+		t1.pushFront(block);
+		return evicted;
+	}
+
+	void hit(Block *block)
+	{
+		++block->refCount;
+		(block->queue == T1 ? t1 : t2).remove(block);
+		block->queue = T2;
+		t2.pushFront(block);
+	}
+
+	void remove(Block *block)
+	{
+		(block->queue == T1 ? t1 : t2).remove(block);
+	}
+
+	void forEach(const std::function<void(Block&)> &func)
+	{
+		for (BlockList *list : {&t1, &t2})
+		{
+			for (Block *block = list->tail; block != nullptr;
+			     block = list->prev(block))
+			{
+				func(*block);
+			}
+		}
+	}
+
+	void clear()
+	{
+		t1 = BlockList();
+		t2 = BlockList();
+		b1.clear();
+		b2.clear();
+		p = 0;
+	}
+};
+
+/* ========== CLOCK-Pro ========== */
+
+/**
+ * An entry in the CLOCK-Pro clock: a resident block (hot or cold), or a
+ * non-resident cold block that is still in its test period, in which case
+ * only its key is kept.
+ */
+struct ClockEntry
+{
+	Block *block;		// nullptr for non-resident entries
+	BlockKey key;		// The key of the (possibly evicted) block
+	bool hot, ref;
+	ClockEntry *prev, *next;// The neighbours in the clock
+};
+
+/**
+ * CLOCK-Pro (Jiang, Chen & Zhang), in the common simplified form where
+ * every resident cold block is in its test period. All the entries are in
+ * one clock with three hands: the cold hand evicts unreferenced cold
+ * blocks (keeping them as non-resident entries) and promotes referenced
+ * ones to hot, the hot hand demotes unreferenced hot blocks and ends the
+ * test periods it passes, and the test hand bounds the number of
+ * non-resident entries. A miss on a non-resident entry makes the block hot
+ * and grows the cold target, and an expired test shrinks it.
+ */
+class ClockProPolicy : public CachePolicy
+{
+public:
+	ClockEntry *handHot, *handCold, *handTest;
+	size_t coldTarget;	// The target number of cold blocks
+	size_t countHot, countCold, countTest;
+	std::unordered_map<BlockKey, ClockEntry*, BlockKeyHash> tests;
+
+	ClockProPolicy(size_t capacity) : CachePolicy(capacity),
+		handHot(nullptr), handCold(nullptr), handTest(nullptr),
+		coldTarget(capacity), countHot(0), countCold(0), countTest(0)
+	{
+	}
+
+	~ClockProPolicy()
+	{
+		clear();
+	}
+
+	const char *name() const
+	{
+		return POLICY_CLOCK_PRO;
+	}
+
+	/**
+	 * Put a new entry in the clock, just behind the hot hand (where the
+	 * hands will get to last).
+	 */
+	void link(ClockEntry *entry)
+	{
+		if (handHot == nullptr)
+		{
+			entry->prev = entry->next = entry;
+			handHot = handCold = handTest = entry;
+			return;
+		}
+		entry->next = handHot;
+		entry->prev = handHot->prev;
+		handHot->prev->next = entry;
+		handHot->prev = entry;
+	}
+
+	/**
+	 * Take an entry out of the clock and free it. Hands that point to it
+	 * move on to the next entry.
+	 */
+	void unlink(ClockEntry *entry)
+	{
+		if (entry->next == entry)
+		{
+			handHot = handCold = handTest = nullptr;
+		}
+		else
+		{
+			for (ClockEntry **hand : {&handHot, &handCold,
+						  &handTest})
+			{
+				if (*hand == entry)
+				{
+					*hand = entry->next;
+				}
+			}
+			entry->prev->next = entry->next;
+			entry->next->prev = entry->prev;
+		}
+		if (entry->block == nullptr)
+		{
+			tests.erase(entry->key);
+			--countTest;
+		}
+		delete entry;
+	}
+
+	/**
+	 * Run the hot hand over one entry: a hot block that wasn't referenced
+	 * since the hand passed it last becomes cold. Passing a non-resident
+	 * entry ends its test period.
+	 */
+	void runHandHot()
+	{
+		ClockEntry *entry = handHot;
+		if (entry->block == nullptr)
+		{
+			// unlink() moves the hand to the next entry
+			endTest(entry);
+			return;
+		}
+		if (entry->hot)
+		{
+			if (entry->ref)
+			{
+				entry->ref = false;
+			}
+			else
+			{
+				entry->hot = false;
+				--countHot;
+				++countCold;
+			}
+		}
+		handHot = handHot->next;
+	}
+
+	/**
+	 * Run the cold hand over one entry: a cold block that was referenced
+	 * during its test period becomes hot, and one that wasn't is evicted
+	 * and stays in the clock as a non-resident entry.
+	 * Returns the evicted block, or nullptr.
+	 */
+	Block *runHandCold()
+	{
+		ClockEntry *entry = handCold;
+		Block *evicted = nullptr;
+		handCold = handCold->next;
+		if (entry->block == nullptr || entry->hot)
+		{
+			return nullptr;
+		}
+		if (entry->ref)
+		{
+			entry->hot = true;
+			entry->ref = false;
+			--countCold;
+			++countHot;
+			return nullptr;
+		}
+		evicted = entry->block;
+		evicted->policyEntry = nullptr;
+		entry->block = nullptr;
+		entry->key = evicted->key();
+		tests[entry->key] = entry;
+		--countCold;
+		++countTest;
+		return evicted;
+	}
+
+	/**
+	 * End the test period of a non-resident entry, which is dropped. It
+	 * wasn't reused in time, so the cold target shrinks.
+	 */
+	void endTest(ClockEntry *entry)
+	{
+		unlink(entry);
+		if (coldTarget > 1)
+		{
+			--coldTarget;
+		}
+	}
+
+	/**
+	 * Run the test hand until it drops a non-resident entry.
+	 */
+	void runHandTest()
+	{
+		while (handTest->block != nullptr)
+		{
+			handTest = handTest->next;
+		}
+		endTest(handTest);
+	}
+
+	/**
+	 * Evict one cold block. The hot hand runs first, until there are no
+	 * more hot blocks than the cold target leaves room for, so there is
+	 * always a cold block for the cold hand to find.
+	 */
+	Block *evict()
+	{
+		Block *evicted = nullptr;
+		while (evicted == nullptr)
+		{
+			while (countHot > capacity - coldTarget)
+			{
+				runHandHot();
+			}
+			evicted = runHandCold();
+		}
+		while (countTest > capacity)
+		{
+			runHandTest();
+		}
+		return evicted;
+	}
+
+	Block *insert(Block *block)
+	{
+		Block *evicted = nullptr;
+		bool hot = false;
+		auto it = tests.find(block->key());
+		if (it != tests.end())
+		{
+			// Reused during its test period
+			hot = true;
+			coldTarget = std::min(coldTarget + 1, capacity);
+			unlink(it->second);
+		}
+		if (countHot + countCold >= capacity)
+		{
+			evicted = evict();
+		}
+
+		ClockEntry *entry = new ClockEntry{block, block->key(), hot,
+						   false, nullptr, nullptr};
+		block->policyEntry = entry;
+		++(hot ? countHot : countCold);
+		link(entry);
+		return evicted;
+	}
+
+	void hit(Block *block)
+	{
+		++block->refCount;
+		((ClockEntry*) block->policyEntry)->ref = true;
+	}
+
+	void remove(Block *block)
+	{
+		ClockEntry *entry = (ClockEntry*) block->policyEntry;
+		--(entry->hot ? countHot : countCold);
+		block->policyEntry = nullptr;
+		unlink(entry);
+	}
+
+	void forEach(const std::function<void(Block&)> &func)
+	{
+		ClockEntry *entry = handCold;
+		do
+		{
+			if (entry != nullptr && entry->block != nullptr)
+			{
+				func(*entry->block);
+			}
+			entry = entry == nullptr ? nullptr : entry->next;
+		} while (entry != handCold);
+	}
+
+	void clear()
+	{
+		while (handHot != nullptr)
+		{
+			if (handHot->block != nullptr)
+			{
+				handHot->block->policyEntry = nullptr;
+			}
+			unlink(handHot);
+		}
+		tests.clear();
+		countHot = countCold = countTest = 0;
+		coldTarget = capacity;
+	}
+};
+
+/* ========== Policy Selection ========== */
+
+/**
+ * Returns true if the given name is the name of a policy.
+ */
+bool isPolicyName(const string &name)
+{
+	return name == POLICY_FBR || name == POLICY_ADAPTIVE_FBR ||
+		name == POLICY_LRU || name == POLICY_LFU ||
+		name == POLICY_2Q || name == POLICY_ARC ||
+		name == POLICY_CLOCK_PRO;
+}
+
+/**
+ * Create the policy with the given name for a cache of the given size.
+ * newIdx and oldIdx are the FBR section boundaries (where they start, for
+ * adaptive FBR) in a cache of nominal blocks, which is capacity unless the
+ * blocks are compressed; the other policies ignore them. Returns nullptr
+ * if there's no such policy.
+ */
+CachePolicy *createPolicy(const string &name, size_t capacity,
+			  size_t newIdx, size_t oldIdx, size_t nominal)
+{
+	if (name == POLICY_FBR)
+	{
+		return new FbrPolicy(capacity, newIdx, oldIdx, nominal);
+	}
+	if (name == POLICY_ADAPTIVE_FBR)
+	{
+		return new AdaptiveFbrPolicy(capacity, newIdx, oldIdx,
+					     nominal);
+	}
+	if (name == POLICY_LRU)
+	{
+		return new LruPolicy(capacity);
+	}
+	if (name == POLICY_LFU)
+	{
+		return new LfuPolicy(capacity);
+	}
+	if (name == POLICY_2Q)
+	{
+		return new TwoQPolicy(capacity);
+	}
+	if (name == POLICY_ARC)
+	{
+		return new ArcPolicy(capacity);
+	}
+	if (name == POLICY_CLOCK_PRO)
+	{
+		return new ClockProPolicy(capacity);
+	}
+	return nullptr;
+}
+
+#endif
@@ -0,0 +1,398 @@
+#ifndef _READAHEAD_H
+#define _READAHEAD_H
+
+#include <deque>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <climits>
+#include "Cache.h"
+#include "WriteBack.h"
+#include "InFlight.h"
+#include "VictimCache.h"
+
+#define READAHEAD_MIN_BLOCKS 4	// The window of a new sequential stream
+#define READAHEAD_MAX_BLOCKS 64	// The window never grows beyond that
+#define READAHEAD_MAX_BYTES (4 * 1024 * 1024)	// ... nor beyond that many
+						// bytes (with large blocks)
+#define READAHEAD_CACHE_SHARE 4	// ... nor beyond 1/4 of the cache
+#define PREFETCH_QUEUE_MAX 64	// Requests beyond that are dropped
+
+/**
+ * Tracks the access pattern of one open file, and decides what to read
+ * ahead. Like the kernel's readahead, a sequential stream starts with a
+ * small window that doubles on every sequential read, and the next batch
+ * is only requested once the reader got within half a window of the end
+ * of what was already read ahead. A read is sequential if it starts where
+ * the previous one ended, or after that but still in the same block (a
+ * reader that skips a little); one that starts before, e.g. reading the
+ * same block again, isn't. A non-sequential read resets it all.
+ */
+class Readahead
+{
+public:
+	size_t nextOffset;	// Where the previous read ended, in bytes
+	size_t window;		// The readahead window, in blocks (0 = off)
+	size_t aheadEnd;	// The first block that wasn't read ahead
+
+	Readahead() : nextOffset(0), window(0), aheadEnd(0)
+	{
+	}
+
+	/**
+	 * Record a read of the bytes offset..endOffset-1 of a file with
+	 * fileBlocks blocks. Returns the number of blocks to read ahead,
+	 * starting at 'from', or 0 if nothing should be read ahead now.
+	 */
+	size_t update(size_t offset, size_t endOffset, size_t fileBlocks,
+		      size_t &from)
+	{
+		bool sequential = offset >= nextOffset &&
+			offset / Block::size == nextOffset / Block::size;
+		size_t last = (endOffset - 1) / Block::size;
+		nextOffset = endOffset;
+		size_t maxWindow = std::min({(size_t) READAHEAD_MAX_BLOCKS,
+				std::max((size_t) 1,
+					 READAHEAD_MAX_BYTES / Block::size),
+				maxSize / READAHEAD_CACHE_SHARE});
+		if (!sequential || maxWindow == 0)
+		{
+			window = aheadEnd = 0;
+			return 0;
+		}
+		window = std::min(window == 0 ? READAHEAD_MIN_BLOCKS :
+				  window * 2, maxWindow);
+
+		size_t start = std::max(aheadEnd, last + 1),
+		       end = std::min(last + 1 + window, fileBlocks);
+		if (start - (last + 1) > window / 2 || end <= start)
+		{
+			return 0;
+		}
+		from = start;
+		aheadEnd = end;
+		return end - start;
+	}
+};
+
+/**
+ * A request to read blocks first..first+count-1 of a file into the cache.
+ * The request owns fd (a dup of the open file's fd), so the file may be
+ * released before the request is handled.
+ */
+struct PrefetchRequest
+{
+	int fd;
+	FileId file;
+	size_t first, count;
+};
+
+/**
+ * A worker thread that reads blocks into the cache in the background. The
+ * blocks are marked as prefetched, so their first real reference doesn't
+ * count as a hit in terms of refCount.
+ */
+class Prefetcher
+{
+public:
+	pthread_t thread;
+	pthread_mutex_t lock;	// Guards all the members below
+	pthread_cond_t cond;	// Signalled when queue or running change
+	pthread_cond_t done;	// Signalled when a fetch is done
+	std::deque<PrefetchRequest> queue;
+	PrefetchRequest current;// The request being fetched, if busy
+	bool running, busy;
+
+	Prefetcher() : running(false), busy(false)
+	{
+		my_pthread_mutex_init(&lock, nullptr);
+		my_pthread_cond_init(&cond, nullptr);
+		my_pthread_cond_init(&done, nullptr);
+	}
+
+	~Prefetcher()
+	{
+		stop();
+		my_pthread_cond_destroy(&done);
+		my_pthread_cond_destroy(&cond);
+		my_pthread_mutex_destroy(&lock);
+	}
+
+	/**
+	 * Start the worker thread.
+	 */
+	void start()
+	{
+		ScopedLock guard(&lock);
+		if (!running)
+		{
+			running = true;
+			my_pthread_create(&thread, nullptr, Prefetcher::run,
+					  this);
+		}
+	}
+
+	/**
+	 * Stop the worker thread and drop the requests it didn't handle.
+	 */
+	void stop()
+	{
+		{
+			ScopedLock guard(&lock);
+			if (!running)
+			{
+				return;
+			}
+			running = false;
+			my_pthread_cond_signal(&cond);
+		}
+		my_pthread_join(thread, nullptr);
+		for (PrefetchRequest &request : queue)
+		{
+			close(request.fd);
+		}
+		queue.clear();
+	}
+
+	/**
+	 * Queue a request, which is dropped (and its fd closed) if the worker
+	 * isn't running or is too far behind.
+	 */
+	void push(const PrefetchRequest &request)
+	{
+		ScopedLock guard(&lock);
+		if (!running || queue.size() >= PREFETCH_QUEUE_MAX)
+		{
+			close(request.fd);
+			return;
+		}
+		queue.push_back(request);
+		my_pthread_cond_signal(&cond);
+	}
+
+	/**
+	 * Called before reading the blocks first..first+count-1 of a file on
+	 * demand, so they aren't read twice: queued requests for the file
+	 * give up those blocks, and if the request being fetched has the 
+	 * first one, this waits until it's done.
+	 * Returns true if it waited, in which case the blocks may be cached
+	 * by now.
+	 */
+	bool claim(const FileId &file, size_t first, size_t count)
+	{
+		ScopedLock guard(&lock);
+		bool waited = false;
+		while (busy && current.file == file &&
+		       current.first <= first && 
+		       first < current.first + current.count)
+		{
+			my_pthread_cond_wait(&done, &lock);
+			waited = true;
+		}
+		size_t end = first + count;
+		for (PrefetchRequest &request : queue)
+		{
+			size_t requestEnd = request.first + request.count;
+			if (request.file != file || 
+			    requestEnd <= first || end <= request.first)
+			{
+				continue;
+			}
+			// Only trim the edges, the middle is rare
+			if (first <= request.first)
+			{
+				request.first = std::min(end, requestEnd);
+			}
+			else if (end >= requestEnd)
+			{
+				requestEnd = first;
+			}
+			request.count = requestEnd - request.first;
+		}
+		return waited;
+	}
+
+	/**
+	 * Move a block from the victim cache into the cache, as a read ahead
+	 * block, unless a read is reading it.
+	 */
+	static void fetchDemoted(const FileId &file, size_t blockNum)
+	{
+		if (inFlight.claim(file, blockNum, 1, false) == 0)
+		{
+			return;
+		}
+		uint64_t stamp = writeBack.stamp(file);
+		Block *block = victimCache.fetch(file, blockNum);
+		if (block != nullptr)
+		{
+			CacheShard &shard = shardOf(file, blockNum);
+			ScopedLock guard(&shard.lock);
+			block->prefetched = true;
+			if (writeBack.stamp(file) != stamp ||
+			    shard.contains(file, blockNum))
+			{
+				delete block;
+			}
+			else if (shard.admit(block, false) == nullptr)
+			{
+				// It's still good, see caching_fill_block
+				victimCache.store(block);
+			}
+			else
+			{
+				countStat(STAT_PREFETCHED);
+			}
+		}
+		inFlight.release(file, blockNum, 1);
+	}
+
+	/**
+	 * Read the missing blocks of the request into the cache, a run of
+	 * consecutive missing blocks at a time. Blocks in the victim cache
+	 * are taken from there instead, since it's faster than the disk.
+	 */
+	static void fetch(const PrefetchRequest &request)
+	{
+		const FileId &file = request.file;
+		size_t end = request.first + request.count;
+		for (size_t blockNum = request.first; blockNum < end; )
+		{
+			// Find the next run of missing blocks
+			vector<Block*> run;
+			vector<struct iovec> iov;
+			uint64_t stamp = writeBack.stamp(file);
+			bool demoted = false;
+			for (; blockNum < end && run.size() < IOV_MAX;
+			     ++blockNum)
+			{
+				CacheShard &shard = shardOf(file, blockNum);
+				ScopedLock guard(&shard.lock);
+				if (shard.contains(file, blockNum))
+				{
+					if (run.empty())
+					{
+						continue;
+					}
+					break;
+				}
+				if (victimCache.contains(file, blockNum))
+				{
+					demoted = run.empty();
+					break;
+				}
+				Block *block = allocBlock(file, blockNum);
+				if (block == nullptr)
+				{
+					break;
+				}
+				run.push_back(block);
+				iov.push_back({block->data, Block::size});
+			}
+			if (demoted)
+			{
+				fetchDemoted(file, blockNum++);
+				continue;
+			}
+			if (run.empty())
+			{
+				break;
+			}
+			// Leave the blocks a read is reading to it
+			size_t claimed = inFlight.claim(file, run[0]->number,
+							run.size(), false);
+			if (claimed < run.size())
+			{
+				blockNum = run[0]->number + std::max(claimed,
+								     (size_t) 1);
+				for (size_t i = claimed; i < run.size(); ++i)
+				{
+					delete run[i];
+				}
+				run.resize(claimed);
+				iov.resize(claimed);
+				if (run.empty())
+				{
+					continue;
+				}
+			}
+
+			// The blocks may be evicted once they're cached
+			size_t runFirst = run[0]->number, runCount = run.size();
+			writeBack.waitForWrites(file);
+			ssize_t got = preadv(request.fd, iov.data(),
+					iov.size(), runFirst * Block::size);
+			// The disk doesn't have the latest size of a file
+			// that is being written, so it isn't read ahead
+			off_t pendingSize;
+			uint64_t newStamp;
+			if (writeBack.fileSize(file, pendingSize, &newStamp) ||
+			    newStamp != stamp)
+			{
+				got = -1;
+			}
+			size_t remaining = got < 0 ? 0 : got;
+			countStat(STAT_PREFETCH_BYTES, remaining);
+			for (Block *block : run)
+			{
+				block->written = std::min(remaining,
+							  Block::size);
+				remaining -= block->written;
+				CacheShard &shard = shardOf(file, 
+							    block->number);
+				ScopedLock guard(&shard.lock);
+				block->prefetched = true;
+				if (block->written == 0 || 
+				    shard.contains(file, block->number) ||
+				    shard.admit(block, false) == nullptr)
+				{
+					delete block;
+					continue;
+				}
+				countStat(STAT_PREFETCHED);
+			}
+			inFlight.release(file, runFirst, runCount);
+			if (got < (ssize_t) (runCount * Block::size))
+			{
+				break; // EOF or error
+			}
+		}
+	}
+
+	/**
+	 * The worker thread's main loop.
+	 */
+	static void *run(void *arg)
+	{
+		Prefetcher *self = (Prefetcher*) arg;
+		while (true)
+		{
+			PrefetchRequest request;
+			{
+				ScopedLock guard(&self->lock);
+				while (self->running && 
+				       self->queue.empty())
+				{
+					my_pthread_cond_wait(&self->cond,
+							     &self->lock);
+				}
+				if (!self->running)
+				{
+					return nullptr;
+				}
+				request = self->queue.front();
+				self->queue.pop_front();
+				self->current = request;
+				self->busy = true;
+			}
+			fetch(request);
+			close(request.fd);
+			ScopedLock guard(&self->lock);
+			self->busy = false;
+			my_pthread_cond_broadcast(&self->done);
+		}
+	}
+};
+
+static Prefetcher prefetcher;	// Reads ahead for all the open files
+
+#endif
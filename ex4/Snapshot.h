@@ -0,0 +1,291 @@
+/**
+ * Cache snapshots: on unmount, the cached blocks are saved to a snapshot
+ * file (-o snapshot=file), and the next mount loads them back, so the
+ * cache starts warm.
+ *
+ * A snapshot file is a SnapshotHeader, an array of SnapshotFiles, an array
+ * of SnapshotBlocks, the files' names, and then, from a page aligned
+ * offset, the blocks' data in the same order as the SnapshotBlocks. All
+ * the parts are fixed size arrays at offsets given by the header, so the
+ * file is simply mapped and read in place when it's loaded.
+ * The blocks are saved in the cache's eviction order (for FBR, from the LRU
+ * block to the MRU one) with their refCounts, so adding them back in that
+ * order restores their recency and frequency.
+ */
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Cache.h"
+
+using std::string;
+using std::vector;
+
+#define SNAPSHOT_MAGIC "CFSSNAPS"
+#define SNAPSHOT_MAGIC_SIZE 8
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_TMP_SUFFIX ".tmp"
+
+static string snapshotPath;	// Empty unless -o snapshot= is given
+
+struct SnapshotHeader
+{
+	char magic[SNAPSHOT_MAGIC_SIZE];
+	uint32_t version;
+	uint32_t blockSize;
+	uint64_t files;		// The number of SnapshotFiles
+	uint64_t blocks;	// The number of SnapshotBlocks (and data blocks)
+	uint64_t namesOffset;	// Where the names start
+	uint64_t dataOffset;	// Where the data starts (page aligned)
+	uint64_t size;		// The size of the whole file
+};
+
+/**
+ * A file that has blocks in the snapshot, and what it looked like when
+ * they were saved. Its blocks are only loaded if the file at the same path
+ * still has the same identity, size and modification time.
+ */
+struct SnapshotFile
+{
+	uint64_t dev, ino;
+	int64_t mtimeSec, mtimeNsec;
+	int64_t size;
+	uint64_t nameOffset;	// From namesOffset; relative to the rootdir
+	uint64_t nameLength;
+};
+
+struct SnapshotBlock
+{
+	uint64_t number;
+	uint64_t refCount;
+	uint64_t written;
+	uint64_t file;		// Index of the block's SnapshotFile
+};
+
+/**
+ * Returns true if st describes the file as it was saved in the snapshot.
+ */
+static bool snapshotFileMatches(const SnapshotFile &file,
+				const struct stat &st)
+{
+	return S_ISREG(st.st_mode) && (uint64_t) st.st_dev == file.dev &&
+		(uint64_t) st.st_ino == file.ino && st.st_size == file.size &&
+		st.st_mtim.tv_sec == file.mtimeSec &&
+		st.st_mtim.tv_nsec == file.mtimeNsec;
+}
+
+/**
+ * Save every cached block to a snapshot file at the given path. nameOf
+ * returns the path (relative to rootdir) of a cached file, or false if
+ * it's unknown; the blocks of unknown files, and of files that no longer
+ * are at their path, aren't saved. The snapshot is written next to path
+ * and renamed over it once complete, so a crash never leaves half a
+ * snapshot behind. Must only be called when nothing else uses the cache.
+ * Returns false on failure.
+ */
+bool saveSnapshot(const string &path, const string &rootdir,
+		  const std::function<bool(const FileId&, string&)> &nameOf)
+{
+	vector<SnapshotFile> files;
+	vector<SnapshotBlock> blocks;
+	vector<const Block*> blockData;
+	string names;
+	// FileId -> index in files, or -1 if its blocks aren't saved
+	std::unordered_map<FileId, int64_t, FileIdHash> fileIndex;
+
+	forEachBlock([&](const Block &block)
+	{
+		std::unordered_map<FileId, int64_t, FileIdHash>::iterator it =
+			fileIndex.find(block.file);
+		if (it == fileIndex.end())
+		{
+			string name;
+			struct stat st;
+			int64_t index = -1;
+			if (nameOf(block.file, name) &&
+			    stat((rootdir + "/" + name).c_str(), &st) == 0 &&
+			    S_ISREG(st.st_mode) && st.st_dev == block.file.dev &&
+			    st.st_ino == block.file.ino)
+			{
+				index = files.size();
+				files.push_back(SnapshotFile{block.file.dev,
+					block.file.ino, st.st_mtim.tv_sec,
+					st.st_mtim.tv_nsec, st.st_size,
+					names.size(), name.size()});
+				names += name;
+			}
+			it = fileIndex.insert(std::make_pair(block.file,
+					index)).first;
+		}
+		if (it->second >= 0)
+		{
+			blocks.push_back(SnapshotBlock{block.number,
+				block.refCount, block.written,
+				(uint64_t) it->second});
+			blockData.push_back(&block);
+		}
+	});
+
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	SnapshotHeader header;
+	memcpy(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+	header.version = SNAPSHOT_VERSION;
+	header.blockSize = Block::size;
+	header.files = files.size();
+	header.blocks = blocks.size();
+	header.namesOffset = sizeof(header) +
+		files.size() * sizeof(SnapshotFile) +
+		blocks.size() * sizeof(SnapshotBlock);
+	header.dataOffset = (header.namesOffset + names.size() + pageSize - 1)
+		/ pageSize * pageSize;
+	header.size = header.dataOffset + blocks.size() * Block::size;
+
+	string tmpPath = path + SNAPSHOT_TMP_SUFFIX;
+	FILE *file = fopen(tmpPath.c_str(), "w");
+	if (file == nullptr)
+	{
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(files.data(), sizeof(SnapshotFile), files.size(),
+		       file) == files.size() &&
+		fwrite(blocks.data(), sizeof(SnapshotBlock), blocks.size(),
+		       file) == blocks.size() &&
+		fwrite(names.data(), 1, names.size(), file) == names.size() &&
+		fseek(file, header.dataOffset, SEEK_SET) == 0;
+	vector<char> buffer(Block::size);	// For compressed blocks
+	for (size_t i = 0; ok && i < blockData.size(); ++i)
+	{
+		const char *data = unpackedData(blockData[i], buffer.data());
+		ok = data != nullptr &&
+			fwrite(data, 1, Block::size, file) == Block::size;
+	}
+	ok = fclose(file) == 0 && ok;
+	if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0)
+	{
+		unlink(tmpPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Load the blocks of the snapshot at the given path into the (empty)
+ * cache, and call onFile with the id and path of every file whose blocks
+ * were loaded. Files that changed since the snapshot was saved are
+ * skipped. If the snapshot has more blocks than the cache holds, only the
+ * ones the cache would evict last are loaded.
+ * Returns the number of blocks loaded, or -1 if the file isn't a snapshot
+ * of this block size.
+ */
+ssize_t loadSnapshot(const string &path, const string &rootdir,
+		     const std::function<void(const FileId&,
+					      const string&)> &onFile)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+	    (size_t) st.st_size < sizeof(SnapshotHeader))
+	{
+		close(fd);
+		return -1;
+	}
+	size_t mapSize = st.st_size;
+	char *map = (char*) mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, fd,
+				 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		return -1;
+	}
+	madvise(map, mapSize, MADV_SEQUENTIAL);
+
+	const SnapshotHeader *header = (const SnapshotHeader*) map;
+	const SnapshotFile *files = (const SnapshotFile*) (header + 1);
+	const SnapshotBlock *blocks = (const SnapshotBlock*)
+		(files + header->files);
+	if (memcmp(header->magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0 ||
+	    header->version != SNAPSHOT_VERSION ||
+	    header->blockSize != Block::size || header->size != mapSize ||
+	    header->files > mapSize / sizeof(SnapshotFile) ||
+	    header->blocks > mapSize / sizeof(SnapshotBlock) ||
+	    header->namesOffset != sizeof(SnapshotHeader) +
+	    header->files * sizeof(SnapshotFile) +
+	    header->blocks * sizeof(SnapshotBlock) ||
+	    header->dataOffset < header->namesOffset ||
+	    header->dataOffset + header->blocks * Block::size != mapSize)
+	{
+		munmap(map, mapSize);
+		return -1;
+	}
+
+	// Which files are still the ones the blocks were saved from
+	vector<bool> valid(header->files, false);
+	for (size_t i = 0; i < header->files; ++i)
+	{
+		const SnapshotFile &file = files[i];
+		if (header->namesOffset + file.nameOffset + file.nameLength >
+		    header->dataOffset)
+		{
+			continue;
+		}
+		string name(map + header->namesOffset + file.nameOffset,
+			    file.nameLength);
+		struct stat fileSt;
+		if (stat((rootdir + "/" + name).c_str(), &fileSt) == 0 &&
+		    snapshotFileMatches(file, fileSt))
+		{
+			valid[i] = true;
+			onFile(FileId{(dev_t) file.dev, (ino_t) file.ino}, name);
+		}
+	}
+
+	ssize_t loaded = 0;
+	size_t first = header->blocks > maxSize ? header->blocks - maxSize : 0;
+	for (size_t i = first; i < header->blocks; ++i)
+	{
+		const SnapshotBlock &saved = blocks[i];
+		if (saved.file >= header->files || !valid[saved.file] ||
+		    saved.written > Block::size)
+		{
+			continue;
+		}
+		const SnapshotFile &file = files[saved.file];
+		FileId id{(dev_t) file.dev, (ino_t) file.ino};
+		CacheShard &shard = shardOf(id, saved.number);
+		ScopedLock lock(&shard.lock);
+		if (shard.contains(id, saved.number))
+		{
+			continue;
+		}
+		Block *block = allocBlock(id, saved.number);
+		if (block == nullptr)
+		{
+			break;
+		}
+		memcpy(block->data, map + header->dataOffset + i * Block::size,
+		       Block::size);
+		block->written = saved.written;
+		block->refCount = saved.refCount;
+		shard.add(block);
+		++loaded;
+	}
+	munmap(map, mapSize);
+	return loaded;
+}
+
+#endif
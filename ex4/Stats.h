@@ -0,0 +1,379 @@
+/**
+ * Live statistics of the filesystem, read through the hidden virtual file
+ * /.cachestats. Every thread counts into its own ThreadStats, so counting
+ * is a plain (relaxed) add to memory no other thread writes, and only
+ * reading the statistics has to visit all the threads.
+ */
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <unordered_set>
+#include "my_pthread.h"
+
+using std::string;
+
+#define STATS_FILE "/.cachestats"
+#define STATS_LINE_MAX 128
+#define STATS_EXTRA_LINES 4	// The ratios and the ops' header
+// renderStats() never returns more, so getattr reports that size
+#define STATS_FILE_MAX ((NUM_STATS + NUM_OPS + STATS_EXTRA_LINES) * \
+			(STATS_LINE_MAX - 1))
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_USEC 1000.0
+
+/**
+ * The counters. See statName for what each one counts.
+ */
+enum Stat
+{
+	STAT_HITS = 0,
+	STAT_MISSES,
+	STAT_EVICTIONS,
+	STAT_CACHE_BYTES,
+	STAT_DISK_BYTES,
+	STAT_PREFETCHED,
+	STAT_PREFETCH_USED,
+	STAT_PREFETCH_UNUSED,
+	STAT_PREFETCH_BYTES,
+	STAT_ARENA_OVERFLOWS,
+	STAT_WRITE_BYTES,
+	STAT_DIRTIED,
+	STAT_DIRTY_EVICTIONS,
+	STAT_WRITEBACKS,
+	STAT_WRITEBACK_BYTES,
+	STAT_ATTR_HITS,
+	STAT_ATTR_MISSES,
+	STAT_PATH_HITS,
+	STAT_PATH_MISSES,
+	STAT_LOG_DROPPED,
+	STAT_ADMISSION_REJECTS,
+	STAT_VICTIM_HITS,
+	STAT_VICTIM_BYTES,
+	STAT_VICTIM_STORES,
+	STAT_VICTIM_EVICTIONS,
+	STAT_VICTIM_DROPS,
+	STAT_DIR_HITS,
+	STAT_DIR_MISSES,
+	STAT_NEGATIVE_HITS,
+	STAT_NEGATIVE_MISSES,
+	STAT_MISS_WAITS,
+	STAT_PACKED,
+	STAT_PACK_REJECTS,
+	STAT_UNPACKED,
+	STAT_UNPACK_NSEC,
+	NUM_STATS
+};
+
+/**
+ * The timed filesystem operations.
+ */
+enum Op
+{
+	OP_GETATTR = 0,
+	OP_FGETATTR,
+	OP_ACCESS,
+	OP_OPEN,
+	OP_READ,
+	OP_FLUSH,
+	OP_RELEASE,
+	OP_OPENDIR,
+	OP_READDIR,
+	OP_RELEASEDIR,
+	OP_RENAME,
+	OP_IOCTL,
+	OP_WRITE,
+	OP_CREATE,
+	OP_TRUNCATE,
+	OP_FTRUNCATE,
+	OP_FSYNC,
+	NUM_OPS
+};
+
+const char *statName[NUM_STATS] =
+{
+	"hits",			// Blocks a read found in the cache
+	"misses",		// Blocks a read had to read from the disk
+	"evictions",		// Blocks evicted to make room for others
+	"cache_bytes",		// Bytes reads copied from cached blocks
+	"disk_bytes",		// Bytes reads read from the disk on a miss
+	"prefetched",		// Blocks read ahead into the cache
+	"prefetch_used",	// ... and later read
+	"prefetch_unused",	// ... and evicted without being read
+	"prefetch_bytes",	// Bytes read from the disk ahead
+	"arena_overflows",	// Block buffers the arena had no room for
+	"write_bytes",		// Bytes writes copied into cached blocks
+	"dirtied",		// Clean blocks that writes made dirty
+	"dirty_evictions",	// ... and were evicted before written back
+	"writebacks",		// Writes of dirty blocks to the disk
+	"writeback_bytes",	// ... and the bytes they wrote
+	"attr_hits",		// getattrs served from the attribute cache
+	"attr_misses",		// ... and the ones that had to stat the file
+	"path_hits",		// Paths resolved by the path cache
+	"path_misses",		// ... and the ones realpath() resolved
+	"log_dropped",		// Log records dropped since the log was behind
+	"admission_rejects",	// Blocks read but kept out by the admission filter
+	"victim_hits",		// Blocks a read found in the victim cache
+	"victim_bytes",		// ... and the bytes read from it for them
+	"victim_stores",	// Evicted blocks stored in the victim cache
+	"victim_evictions",	// ... and the ones it evicted for them
+	"victim_drops",		// Evicted blocks dropped since it was behind
+	"dir_hits",		// Directory listings served from the cache
+	"dir_misses",		// ... and the ones read from the directory
+	"negative_hits",	// getattrs of missing paths the cache answered
+	"negative_misses",	// ... and the ones lstat() answered
+	"miss_waits",		// Misses that waited for another read of the block
+	"packed",		// Blocks compressed as they left the new section
+	"pack_rejects",		// ... and the ones that didn't compress enough
+	"unpacked",		// Compressed blocks decompressed on a hit
+	"unpack_nsec"		// ... and the time it took
+};
+
+const char *opName[NUM_OPS] =
+{
+	"getattr", "fgetattr", "access", "open", "read", "flush", "release",
+	"opendir", "readdir", "releasedir", "rename", "ioctl", "write",
+	"create", "truncate", "ftruncate", "fsync"
+};
+
+/**
+ * The latency of one operation.
+ */
+struct OpLatency
+{
+	std::atomic<uint64_t> count, totalNsec, maxNsec;
+};
+
+/**
+ * The counters of one thread. Only the owner writes them, so they are
+ * atomic only to let other threads read them.
+ */
+class ThreadStats
+{
+public:
+	std::atomic<uint64_t> counters[NUM_STATS];
+	OpLatency ops[NUM_OPS];
+	bool registered;	// Whether these are the stats of a thread
+
+	ThreadStats(bool ofThread = true);
+	~ThreadStats();
+
+	/**
+	 * Reset all the counters to 0.
+	 */
+	void reset()
+	{
+		for (std::atomic<uint64_t> &counter : counters)
+		{
+			counter.store(0, std::memory_order_relaxed);
+		}
+		for (OpLatency &op : ops)
+		{
+			op.count.store(0, std::memory_order_relaxed);
+			op.totalNsec.store(0, std::memory_order_relaxed);
+			op.maxNsec.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	/**
+	 * Add value to the given counter (only called by the owner).
+	 */
+	static void add(std::atomic<uint64_t> &counter, uint64_t value)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + value,
+			      std::memory_order_relaxed);
+	}
+
+	/**
+	 * Add the counters of other to these ones.
+	 */
+	void merge(const ThreadStats &other)
+	{
+		for (int s = 0; s < NUM_STATS; ++s)
+		{
+			add(counters[s], other.counters[s].load(
+					std::memory_order_relaxed));
+		}
+		for (int o = 0; o < NUM_OPS; ++o)
+		{
+			add(ops[o].count, other.ops[o].count.load(
+					std::memory_order_relaxed));
+			add(ops[o].totalNsec, other.ops[o].totalNsec.load(
+					std::memory_order_relaxed));
+			ops[o].maxNsec.store(std::max(ops[o].maxNsec.load(
+					std::memory_order_relaxed),
+				other.ops[o].maxNsec.load(
+					std::memory_order_relaxed)),
+				std::memory_order_relaxed);
+		}
+	}
+};
+
+/**
+ * All the threads' stats. The stats of threads that exited are merged
+ * into 'retired', so they aren't lost.
+ */
+class StatsRegistry
+{
+public:
+	pthread_mutex_t lock;	// Guards the members below
+	std::unordered_set<ThreadStats*> threads;
+	ThreadStats retired;
+
+	StatsRegistry() : retired(false)
+	{
+		my_pthread_mutex_init(&lock, nullptr);
+	}
+
+	~StatsRegistry()
+	{
+		my_pthread_mutex_destroy(&lock);
+	}
+
+	/**
+	 * Add the stats of all the threads to total.
+	 */
+	void sum(ThreadStats &total)
+	{
+		ScopedLock guard(&lock);
+		total.merge(retired);
+		for (ThreadStats *stats : threads)
+		{
+			total.merge(*stats);
+		}
+	}
+};
+
+// Not a member of ThreadStats, which registers in it
+static StatsRegistry statsRegistry;
+
+ThreadStats::ThreadStats(bool ofThread) : registered(ofThread)
+{
+	reset();
+	if (registered)
+	{
+		ScopedLock guard(&statsRegistry.lock);
+		statsRegistry.threads.insert(this);
+	}
+}
+
+ThreadStats::~ThreadStats()
+{
+	if (registered)
+	{
+		ScopedLock guard(&statsRegistry.lock);
+		statsRegistry.threads.erase(this);
+		statsRegistry.retired.merge(*this);
+	}
+}
+
+/**
+ * Returns the calling thread's stats, which are created on its first call.
+ */
+ThreadStats &threadStats()
+{
+	static thread_local ThreadStats stats;
+	return stats;
+}
+
+/**
+ * Add value to the given counter of the calling thread.
+ */
+void countStat(Stat stat, uint64_t value = 1)
+{
+	ThreadStats::add(threadStats().counters[stat], value);
+}
+
+/**
+ * Measures the latency of an operation, from construction to destruction,
+ * so it covers every return path of the operation.
+ */
+class OpTimer
+{
+public:
+	Op op;
+	struct timespec start;
+
+	OpTimer(Op timedOp) : op(timedOp)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	}
+
+	~OpTimer()
+	{
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		uint64_t nsec = (end.tv_sec - start.tv_sec) * NSEC_PER_SEC +
+			end.tv_nsec - start.tv_nsec;
+		OpLatency &latency = threadStats().ops[op];
+		ThreadStats::add(latency.count, 1);
+		ThreadStats::add(latency.totalNsec, nsec);
+		if (nsec > latency.maxNsec.load(std::memory_order_relaxed))
+		{
+			latency.maxNsec.store(nsec, std::memory_order_relaxed);
+		}
+	}
+
+	OpTimer(const OpTimer &other) = delete;
+	OpTimer& operator= (const OpTimer &other) = delete;
+};
+
+/**
+ * Returns the contents of the stats file: one "name value" line per
+ * counter and derived ratio, then one line per operation with its count
+ * and average and maximal latency in microseconds.
+ */
+string renderStats()
+{
+	ThreadStats total(false);
+	statsRegistry.sum(total);
+	uint64_t value[NUM_STATS];
+	for (int s = 0; s < NUM_STATS; ++s)
+	{
+		value[s] = total.counters[s].load(std::memory_order_relaxed);
+	}
+
+	string out;
+	char line[STATS_LINE_MAX];
+	for (int s = 0; s < NUM_STATS; ++s)
+	{
+		snprintf(line, sizeof(line), "%s %llu\n", statName[s],
+			 (unsigned long long) value[s]);
+		out += line;
+	}
+	// The share of the blocks read that each tier served
+	uint64_t reads = value[STAT_HITS] + value[STAT_VICTIM_HITS] +
+		value[STAT_MISSES];
+	snprintf(line, sizeof(line), "hit_ratio %.4f\n",
+		 reads == 0 ? 0.0 : (double) value[STAT_HITS] / reads);
+	out += line;
+	snprintf(line, sizeof(line), "victim_hit_ratio %.4f\n",
+		 reads == 0 ? 0.0 : (double) value[STAT_VICTIM_HITS] / reads);
+	out += line;
+	snprintf(line, sizeof(line), "prefetch_accuracy %.4f\n",
+		 value[STAT_PREFETCHED] == 0 ? 0.0 :
+		 (double) value[STAT_PREFETCH_USED] / value[STAT_PREFETCHED]);
+	out += line;
+
+	out += "op count avg_us max_us\n";
+	for (int o = 0; o < NUM_OPS; ++o)
+	{
+		uint64_t count = total.ops[o].count.load(
+			std::memory_order_relaxed);
+		snprintf(line, sizeof(line), "%s %llu %.1f %.1f\n", opName[o],
+			 (unsigned long long) count, count == 0 ? 0.0 :
+			 total.ops[o].totalNsec.load(
+				 std::memory_order_relaxed) / NSEC_PER_USEC /
+			 count,
+			 total.ops[o].maxNsec.load(std::memory_order_relaxed) /
+			 NSEC_PER_USEC);
+		out += line;
+	}
+	return out;
+}
+
+#endif
@@ -0,0 +1,196 @@
+/**
+ * Block access traces: CachingFileSystem records the blocks every read asks
+ * for (-o trace=file), and CacheSim replays them against the cache offline.
+ *
+ * A trace file is a TraceHeader followed by TraceRecords. A record with a
+ * zero count names a file instead of describing a read: its 'first' field
+ * holds the length of the name, which follows the record. Every file is
+ * named once, before its first read.
+ */
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <functional>
+#include "my_pthread.h"
+#include "Block.h"
+
+using std::string;
+
+#define TRACE_MAGIC "CFSTRACE"
+#define TRACE_MAGIC_SIZE 8
+#define TRACE_VERSION 1
+#define TRACE_NAME_RECORD 0	// The count of a record that names a file
+#define NSEC_PER_SEC 1000000000ULL
+
+struct TraceHeader
+{
+	char magic[TRACE_MAGIC_SIZE];
+	uint32_t version;
+	uint32_t blockSize;	// The block size of the traced mount
+};
+
+struct TraceRecord
+{
+	uint64_t time;		// Nanoseconds since the trace started
+	uint64_t first;		// The first block read (or the name length)
+	uint32_t count;		// The number of blocks read
+	uint32_t fileId;	// Set by the file's name record
+};
+
+/**
+ * Returns the current time of the monotonic clock, in nanoseconds.
+ */
+uint64_t monotonicNsec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+/**
+ * Appends trace records to a trace file. Fuse calls the operations from
+ * several threads, so the file is only written while holding lock. The
+ * records go through stdio's buffer, so a read costs a short critical
+ * section and no system call.
+ */
+class TraceWriter
+{
+public:
+	FILE *file;		// nullptr when not tracing
+	pthread_mutex_t lock;
+	uint64_t start;		// When the trace started
+	std::unordered_map<FileId, uint32_t, FileIdHash> ids; // -> trace id
+
+	TraceWriter() : file(nullptr), start(0)
+	{
+		my_pthread_mutex_init(&lock, nullptr);
+	}
+
+	~TraceWriter()
+	{
+		close();
+		my_pthread_mutex_destroy(&lock);
+	}
+
+	/**
+	 * Start a new trace in the given file. Returns false if it can't be
+	 * written.
+	 */
+	bool open(const string &path, size_t blockSize)
+	{
+		ScopedLock guard(&lock);
+		file = fopen(path.c_str(), "w");
+		if (file == nullptr)
+		{
+			return false;
+		}
+		TraceHeader header;
+		memcpy(header.magic, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+		header.version = TRACE_VERSION;
+		header.blockSize = blockSize;
+		start = monotonicNsec();
+		// Flush now, before fuse forks to the background
+		return fwrite(&header, sizeof(header), 1, file) == 1 &&
+			fflush(file) == 0;
+	}
+
+	/**
+	 * Record a read of the blocks first..first+count-1 of a file. The
+	 * path is only recorded on the file's first read. Does nothing if not
+	 * tracing.
+	 */
+	void record(const FileId &fileId, const char *path, size_t first,
+		    size_t count)
+	{
+		if (file == nullptr)
+		{
+			return;
+		}
+		uint64_t now = monotonicNsec();
+		ScopedLock guard(&lock);
+		std::unordered_map<FileId, uint32_t, FileIdHash>::iterator it =
+			ids.find(fileId);
+		if (it == ids.end())
+		{
+			it = ids.insert(std::make_pair(fileId,
+					ids.size())).first;
+			size_t length = strlen(path);
+			TraceRecord name{now - start, length,
+					 TRACE_NAME_RECORD, it->second};
+			fwrite(&name, sizeof(name), 1, file);
+			fwrite(path, length, 1, file);
+		}
+		TraceRecord read{now - start, first, (uint32_t) count,
+				 it->second};
+		fwrite(&read, sizeof(read), 1, file);
+	}
+
+	/**
+	 * Flush and close the trace file.
+	 */
+	void close()
+	{
+		ScopedLock guard(&lock);
+		if (file != nullptr)
+		{
+			fclose(file);
+			file = nullptr;
+		}
+		ids.clear();
+	}
+};
+
+/**
+ * Read the trace file at the given path, and call onName for every file
+ * name record and onRead for every read record, in order. Returns false if
+ * the file can't be read or isn't a trace (records after a truncated one
+ * are ignored).
+ */
+bool readTrace(const string &path, size_t &blockSize,
+	       const std::function<void(uint32_t, const string&)> &onName,
+	       const std::function<void(const TraceRecord&)> &onRead)
+{
+	FILE *file = fopen(path.c_str(), "r");
+	if (file == nullptr)
+	{
+		return false;
+	}
+	TraceHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+	    memcmp(header.magic, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0 ||
+	    header.version != TRACE_VERSION)
+	{
+		fclose(file);
+		return false;
+	}
+	blockSize = header.blockSize;
+
+	TraceRecord record;
+	string name;
+	while (fread(&record, sizeof(record), 1, file) == 1)
+	{
+		if (record.count != TRACE_NAME_RECORD)
+		{
+			onRead(record);
+			continue;
+		}
+		name.resize(record.first);
+		if (fread(&name[0], 1, name.size(), file) != name.size())
+		{
+			break;
+		}
+		onName(record.fileId, name);
+	}
+	fclose(file);
+	return true;
+}
+
+static TraceWriter tracer;	// Records the reads, if -o trace= is given
+
+#endif
@@ -0,0 +1,562 @@
+/**
+ * The victim cache: a second cache tier, in a file on a local disk (e.g. an
+ * SSD, with -o victim_cache=file), for the clean blocks the cache evicts
+ * from memory. A read that misses the memory looks for the block there
+ * before going to the rootdir, which may be much slower (e.g. over the
+ * network). A block leaves the victim cache when it's read (it goes back
+ * to memory), when its data changes, or when it's the oldest one there and
+ * its slot is needed, so the victim cache evicts blocks in the order they
+ * left the memory. It holds up to -o victim_blocks= blocks.
+ * Evicted blocks are written to the file by a writer thread, so the miss
+ * that evicted them doesn't wait for the disk: until a block is written,
+ * it's kept in a queue in memory, where reads can still find it. If the
+ * writer is too far behind, evicted blocks are dropped instead.
+ * The file is unlinked as soon as it's opened, since its contents mean
+ * nothing without the index, which is only kept in memory.
+ */
+#ifndef _VICTIMCACHE_H
+#define _VICTIMCACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Block.h"
+#include "Compress.h"
+#include "Stats.h"
+#include "my_pthread.h"
+
+using std::vector;
+
+#define DEF_VICTIM_CACHE_SHARE 4	// Default size, in memory caches
+#define VICTIM_OPEN_FLAGS O_RDWR | O_CREAT | O_TRUNC
+#define VICTIM_FILE_MODE 0600
+#define NO_SLOT SIZE_MAX
+#define VICTIM_QUEUE_BYTES (8 * 1024 * 1024)	// The most block data that
+							// waits to be written
+
+/**
+ * A block's place in the victim cache file, at slot number * Block::size.
+ * The slots that hold blocks are linked from the newest to the oldest.
+ */
+struct VictimSlot
+{
+	BlockKey key;
+	size_t written;		// The bytes the block holds
+	size_t newer, older;	// Neighbour slots, or NO_SLOT
+};
+
+typedef std::unordered_map<BlockKey, size_t, BlockKeyHash> SlotIndex;
+typedef std::unordered_map<BlockKey, Block*, BlockKeyHash> PendingIndex;
+
+class VictimCache
+{
+public:
+	pthread_t thread;	// The writer
+	pthread_mutex_t lock;	// Guards the members below
+	pthread_cond_t cond;	// Signalled when queue or running change
+	pthread_cond_t done;	// Broadcast when a block is written
+	int fd;			// -1 if there's no victim cache
+	size_t capacity;	// In blocks
+	vector<VictimSlot> slots;	// Grows up to capacity
+	SlotIndex index;		// Block key -> its slot
+	vector<size_t> freeSlots;	// Slots that are in neither list
+	size_t newest, oldest;
+	PendingIndex pending;		// Block key -> its block, until the
+					// writer takes it
+	std::deque<BlockKey> queue;	// Their keys, oldest first (the keys
+					// of blocks that left pending stay)
+	Block *writing;		// The block being written, if any
+	bool dropped;		// Its data changed while it was written
+	bool running;
+	char *buffer;		// Where compressed blocks are decompressed
+
+	VictimCache() : fd(-1), capacity(0), newest(NO_SLOT), oldest(NO_SLOT),
+		writing(nullptr), dropped(false), running(false),
+		buffer(nullptr)
+	{
+		my_pthread_mutex_init(&lock, nullptr);
+		my_pthread_cond_init(&cond, nullptr);
+		my_pthread_cond_init(&done, nullptr);
+	}
+
+	~VictimCache()
+	{
+		close();
+		my_pthread_cond_destroy(&done);
+		my_pthread_cond_destroy(&cond);
+		my_pthread_mutex_destroy(&lock);
+	}
+
+	/**
+	 * Keep up to the given number of blocks in a new file at path.
+	 * Returns false if the file can't be created.
+	 */
+	bool open(const char *path, size_t blocks)
+	{
+		ScopedLock guard(&lock);
+		// Without O_DIRECT the page cache would keep the blocks in
+		// memory again, but not every filesystem supports it
+		fd = ::open(path, VICTIM_OPEN_FLAGS | O_DIRECT,
+			    VICTIM_FILE_MODE);
+		if (fd < 0)
+		{
+			fd = ::open(path, VICTIM_OPEN_FLAGS, VICTIM_FILE_MODE);
+		}
+		if (fd < 0)
+		{
+			return false;
+		}
+		::unlink(path);
+		capacity = blocks;
+		// Aligned like the blocks' own buffers, for O_DIRECT
+		buffer = (char*) aligned_alloc(Block::size, Block::size);
+		return buffer != nullptr;
+	}
+
+	/**
+	 * Start the writer thread, if there's a victim cache.
+	 */
+	void start()
+	{
+		ScopedLock guard(&lock);
+		if (fd >= 0 && !running)
+		{
+			running = true;
+			my_pthread_create(&thread, nullptr, VictimCache::run,
+					  this);
+		}
+	}
+
+	/**
+	 * Stop the writer thread. The blocks it didn't write stay queued.
+	 */
+	void stop()
+	{
+		{
+			ScopedLock guard(&lock);
+			if (!running)
+			{
+				return;
+			}
+			running = false;
+			my_pthread_cond_signal(&cond);
+		}
+		my_pthread_join(thread, nullptr);
+	}
+
+	/**
+	 * Drop all the blocks and close the file.
+	 */
+	void close()
+	{
+		stop();
+		ScopedLock guard(&lock);
+		if (fd >= 0)
+		{
+			::close(fd);
+			fd = -1;
+		}
+		free(buffer);
+		buffer = nullptr;
+		slots.clear();
+		index.clear();
+		freeSlots.clear();
+		newest = oldest = NO_SLOT;
+		for (const std::pair<const BlockKey, Block*> &entry : pending)
+		{
+			delete entry.second;
+		}
+		pending.clear();
+		queue.clear();
+	}
+
+	/**
+	 * Returns true if there's a victim cache. Doesn't change after mount.
+	 */
+	bool enabled() const
+	{
+		return fd >= 0;
+	}
+
+	/**
+	 * Link the slot as the newest one.
+	 */
+	void link(size_t slot)
+	{
+		slots[slot].newer = NO_SLOT;
+		slots[slot].older = newest;
+		if (newest != NO_SLOT)
+		{
+			slots[newest].newer = slot;
+		}
+		else
+		{
+			oldest = slot;
+		}
+		newest = slot;
+	}
+
+	/**
+	 * Unlink the slot from the list.
+	 */
+	void unlink(size_t slot)
+	{
+		VictimSlot &s = slots[slot];
+		if (s.newer != NO_SLOT)
+		{
+			slots[s.newer].older = s.older;
+		}
+		else
+		{
+			newest = s.older;
+		}
+		if (s.older != NO_SLOT)
+		{
+			slots[s.older].newer = s.newer;
+		}
+		else
+		{
+			oldest = s.newer;
+		}
+	}
+
+	/**
+	 * Drop the block in the slot the iterator points to.
+	 */
+	void release(SlotIndex::iterator it)
+	{
+		unlink(it->second);
+		freeSlots.push_back(it->second);
+		index.erase(it);
+	}
+
+	/**
+	 * Returns true if the block is in the victim cache.
+	 */
+	bool contains(const FileId &file, size_t num)
+	{
+		if (fd < 0)
+		{
+			return false;
+		}
+		ScopedLock guard(&lock);
+		BlockKey key{file, num};
+		return index.count(key) != 0 || pending.count(key) != 0 ||
+			(writing != nullptr && writing->key() == key);
+	}
+
+	/**
+	 * Take over a clean block that's evicted from the memory, and queue
+	 * it to be written to the file (or free it if the writer isn't
+	 * running or is too far behind). Called with the block's shard lock
+	 * held, so it can't be dropped (because its data changed) before it's
+	 * queued.
+	 */
+	void store(Block *block)
+	{
+		ScopedLock guard(&lock);
+		size_t maxPending = std::max(VICTIM_QUEUE_BYTES / Block::size,
+					     (size_t) 1);
+		if (!running || capacity == 0 || pending.size() >= maxPending)
+		{
+			if (running && capacity != 0)
+			{
+				countStat(STAT_VICTIM_DROPS);
+			}
+			delete block;
+			return;
+		}
+		BlockKey key = block->key();
+		SlotIndex::iterator it = index.find(key);
+		if (it != index.end())
+		{
+			release(it);
+		}
+		Block *&queued = pending[key];
+		if (queued != nullptr)
+		{
+			delete queued;
+		}
+		else
+		{
+			queue.push_back(key);
+		}
+		queued = block;
+		my_pthread_cond_signal(&cond);
+	}
+
+	/**
+	 * Returns a slot for a new block, in place of the oldest block if the
+	 * victim cache is full, or NO_SLOT if every slot is being read.
+	 */
+	size_t takeSlot()
+	{
+		size_t slot = NO_SLOT;
+		if (!freeSlots.empty())
+		{
+			slot = freeSlots.back();
+			freeSlots.pop_back();
+		}
+		else if (slots.size() < capacity)
+		{
+			slot = slots.size();
+			slots.push_back(VictimSlot());
+		}
+		else if (oldest != NO_SLOT)
+		{
+			slot = oldest;
+			unlink(slot);
+			index.erase(slots[slot].key);
+			countStat(STAT_VICTIM_EVICTIONS);
+		}
+		return slot;
+	}
+
+	/**
+	 * The writer thread's main loop: write the queued blocks to their
+	 * slots, without holding the lock while writing, and only then add
+	 * them to the index (unless they were dropped meanwhile).
+	 */
+	static void *run(void *arg)
+	{
+		VictimCache *self = (VictimCache*) arg;
+		ScopedLock guard(&self->lock);
+		while (self->running)
+		{
+			if (self->queue.empty())
+			{
+				my_pthread_cond_wait(&self->cond, &self->lock);
+				continue;
+			}
+			BlockKey key = self->queue.front();
+			self->queue.pop_front();
+			PendingIndex::iterator it = self->pending.find(key);
+			if (it == self->pending.end())
+			{
+				continue; // Read or dropped meanwhile
+			}
+			Block *block = it->second;
+			self->pending.erase(it);
+			size_t slot = self->takeSlot();
+			if (slot == NO_SLOT)
+			{
+				delete block;
+				continue;
+			}
+			self->writing = block;
+			self->dropped = false;
+			my_pthread_mutex_unlock(&self->lock);
+			// The whole (aligned) buffer, as O_DIRECT needs
+			const char *data = unpackedData(block, self->buffer);
+			bool written = data != nullptr &&
+				pwrite(self->fd, data, Block::size,
+				       slot * Block::size) ==
+				(ssize_t) Block::size;
+			my_pthread_mutex_lock(&self->lock);
+			self->writing = nullptr;
+			if (written && !self->dropped)
+			{
+				// In case it was stored again meanwhile
+				SlotIndex::iterator old = self->index.find(key);
+				if (old != self->index.end())
+				{
+					self->release(old);
+				}
+				self->slots[slot].key = key;
+				self->slots[slot].written = block->written;
+				self->index[key] = slot;
+				self->link(slot);
+				countStat(STAT_VICTIM_STORES);
+			}
+			else
+			{
+				self->freeSlots.push_back(slot);
+			}
+			delete block;
+			my_pthread_cond_broadcast(&self->done);
+		}
+		return nullptr;
+	}
+
+	/**
+	 * Returns a new block, which the caller owns, with the data of a
+	 * block that was queued but not written. It's unpacked, since the
+	 * reader needs its data, or nullptr is returned if it can't be (or
+	 * there's no memory for it).
+	 */
+	static Block *requeued(Block *queued)
+	{
+		Block *block = allocBlock(queued->file, queued->number);
+		if (block == nullptr)
+		{
+			delete queued;
+			return nullptr;
+		}
+		std::swap(block->data, queued->data);
+		std::swap(block->packed, queued->packed);
+		std::swap(block->packedSize, queued->packedSize);
+		block->written = queued->written;
+		delete queued;
+		if (block->packed != nullptr && !unpackBlock(block))
+		{
+			delete block;
+			return nullptr;
+		}
+		return block;
+	}
+
+	/**
+	 * Take the block out of the victim cache. Returns a new block with
+	 * its data, which the caller owns, or nullptr if it isn't there.
+	 * A block that's still queued is taken from the queue, and one that's
+	 * being written is waited for. The file is read without holding the
+	 * lock: the slot stays out of the lists meanwhile, so it isn't reused.
+	 */
+	Block *fetch(const FileId &file, size_t num)
+	{
+		if (fd < 0)
+		{
+			return nullptr;
+		}
+		size_t slot = NO_SLOT, written;
+		Block *block = nullptr;
+		{
+			ScopedLock guard(&lock);
+			BlockKey key{file, num};
+			while (writing != nullptr && writing->key() == key)
+			{
+				my_pthread_cond_wait(&done, &lock);
+			}
+			PendingIndex::iterator queued = pending.find(key);
+			SlotIndex::iterator it;
+			if (queued != pending.end())
+			{
+				block = queued->second;
+				pending.erase(queued);
+			}
+			else if ((it = index.find(key)) != index.end())
+			{
+				slot = it->second;
+				written = slots[slot].written;
+				unlink(slot);
+				index.erase(it);
+			}
+			else
+			{
+				return nullptr;
+			}
+		}
+		if (block != nullptr)
+		{
+			block = requeued(block);
+			if (block == nullptr)
+			{
+				return nullptr;
+			}
+			written = block->written;
+		}
+		else
+		{
+			block = allocBlock(file, num);
+			ssize_t got = block == nullptr ? -1 :
+				pread(fd, block->data, Block::size,
+				      slot * Block::size);
+			{
+				ScopedLock guard(&lock);
+				freeSlots.push_back(slot);
+			}
+			if (got < (ssize_t) written)
+			{
+				delete block;
+				return nullptr;
+			}
+			block->written = written;
+		}
+		countStat(STAT_VICTIM_HITS);
+		countStat(STAT_VICTIM_BYTES, written);
+		return block;
+	}
+
+	/**
+	 * Drop the copies of the file's blocks from first up to (not
+	 * including) end, since their data changed, whether they're written
+	 * or still queued. Long ranges are dropped by visiting every block in
+	 * the victim cache instead.
+	 */
+	void drop(const FileId &file, size_t first, size_t end)
+	{
+		if (fd < 0)
+		{
+			return;
+		}
+		ScopedLock guard(&lock);
+		if (writing != nullptr && writing->file == file &&
+		    writing->number >= first && writing->number < end)
+		{
+			dropped = true;
+		}
+		if (end - first <= index.size() + pending.size())
+		{
+			for (size_t num = first; num < end; ++num)
+			{
+				BlockKey key{file, num};
+				SlotIndex::iterator it = index.find(key);
+				if (it != index.end())
+				{
+					release(it);
+				}
+				PendingIndex::iterator queued =
+					pending.find(key);
+				if (queued != pending.end())
+				{
+					delete queued->second;
+					pending.erase(queued);
+				}
+			}
+			return;
+		}
+		for (SlotIndex::iterator it = index.begin();
+		     it != index.end();)
+		{
+			if (it->first.file == file &&
+			    it->first.number >= first && it->first.number < end)
+			{
+				release(it++);
+			}
+			else
+			{
+				++it;
+			}
+		}
+		for (PendingIndex::iterator it = pending.begin();
+		     it != pending.end();)
+		{
+			if (it->first.file == file &&
+			    it->first.number >= first && it->first.number < end)
+			{
+				delete it->second;
+				it = pending.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+};
+
+static VictimCache victimCache;	// The blocks evicted from the memory
+
+/**
+ * The cache's evictCleanBlock hook.
+ */
+void demoteBlock(Block *block)
+{
+	victimCache.store(block);
+}
+
+#endif
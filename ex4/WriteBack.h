@@ -0,0 +1,659 @@
+/**
+ * Write-back caching: a write only changes cached blocks and marks them
+ * dirty, and a worker thread (the flusher) writes the dirty blocks back to
+ * the disk later, a run of consecutive blocks per system call, so many
+ * small writes turn into a few large ones.
+ *
+ * A file's dirty blocks are written back once the oldest of them has been
+ * dirty for longer than the expire time (-o dirty_expire=), when the file
+ * is fsynced or released, or when too many blocks are dirty (-o dirty_max=),
+ * in which case writers also wait for the flusher. A dirty block the cache
+ * evicts is handed to the flusher, which writes it before freeing it.
+ *
+ * All the write backs are done by the flusher thread, so the writes of a
+ * block reach the disk in order. Blocks are copied while their shard is
+ * locked and written after it's unlocked, so a block may leave the cache
+ * before its data is on the disk; a miss therefore waits for the write
+ * backs of its file before reading from the disk (waitForWrites). A block
+ * may also be written and leave the cache while a miss reads it from the
+ * disk, so a block read from the disk is only cached if the file's stamp
+ * didn't change since before the miss.
+ */
+#ifndef _WRITEBACK_H
+#define _WRITEBACK_H
+
+#include <set>
+#include <atomic>
+#include <map>
+#include <vector>
+#include <unordered_map>
+#include <ctime>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "my_pthread.h"
+#include "Cache.h"
+#include "Trace.h"
+
+using std::vector;
+
+#define DEF_DIRTY_EXPIRE_MSEC 5000	// How long data may stay dirty
+#define DEF_DIRTY_CACHE_SHARE 2		// At most 1/2 of the cache is dirty
+#define WRITEBACK_MAX_RUN 64		// The most blocks one write back writes
+#define WRITEBACK_MAX_RUN_BYTES (4 * 1024 * 1024)	// ... and bytes
+#define WRITEBACK_MAX_SLEEP_MSEC 1000	// The flusher looks at least that often
+#define WRITEBACK_MIN_SLEEP_MSEC 10
+#define NSEC_PER_MSEC 1000000ULL
+
+/**
+ * The write back state of a file that is open for writing.
+ */
+struct DirtyFile
+{
+	int fd;			// A dup of a writable fd of the file
+	size_t opens;		// The open files that may write it
+	off_t size;		// Its size, including data not written back
+	std::set<size_t> dirty;	// The numbers of its dirty cached blocks
+	uint64_t dirtiedAt;	// When its oldest dirty block was dirtied
+	std::map<size_t, Block*> evicted; // Evicted dirty blocks, owned here
+	bool writing;		// Whether its blocks are being written back
+	uint64_t syncRequested;	// The number of sync requests, and how many
+	uint64_t syncDone;	// ... of them were served
+	int error;		// The first write back error not reported yet
+	uint64_t stamp;		// Changes when its blocks may leave the
+				// cache before their data is on the disk
+};
+
+/**
+ * Tracks the dirty blocks of all the files, and runs the flusher thread.
+ * Lock order: a shard's lock may be held when taking lock, never the other
+ * way around.
+ */
+class WriteBack
+{
+public:
+	pthread_t thread;
+	pthread_mutex_t lock;	// Guards all the members below
+	pthread_cond_t wake;	// Signalled when the flusher has urgent work
+	pthread_cond_t done;	// Signalled when blocks were written back
+	std::unordered_map<FileId, DirtyFile, FileIdHash> files;
+	std::atomic<size_t> tracked;	// files.size(), read without lock
+	size_t dirtyBlocks;	// Of all the files, including evicted ones
+	size_t maxDirty;	// Writers wait while that many are dirty
+	uint64_t expireNsec;	// How long a file's data may stay dirty
+	std::atomic<uint64_t> stamps;	// The last stamp given to a file
+	bool running;
+
+	WriteBack() : tracked(0), dirtyBlocks(0), maxDirty(1),
+		expireNsec(DEF_DIRTY_EXPIRE_MSEC * NSEC_PER_MSEC), stamps(0),
+		running(false)
+	{
+		my_pthread_mutex_init(&lock, nullptr);
+		my_pthread_cond_init(&wake, nullptr);
+		my_pthread_cond_init(&done, nullptr);
+	}
+
+	~WriteBack()
+	{
+		stop();
+		my_pthread_cond_destroy(&done);
+		my_pthread_cond_destroy(&wake);
+		my_pthread_mutex_destroy(&lock);
+	}
+
+	/**
+	 * Set the expire time (0 writes every write back right away) and the
+	 * most blocks that may be dirty at once.
+	 */
+	void configure(size_t expireMsec, size_t maxDirtyBlocks)
+	{
+		ScopedLock guard(&lock);
+		expireNsec = expireMsec * NSEC_PER_MSEC;
+		maxDirty = std::max((size_t) 1, maxDirtyBlocks);
+	}
+
+	/**
+	 * Start the flusher thread.
+	 */
+	void start()
+	{
+		ScopedLock guard(&lock);
+		if (!running)
+		{
+			running = true;
+			my_pthread_create(&thread, nullptr, WriteBack::run,
+					  this);
+		}
+	}
+
+	/**
+	 * Stop the flusher thread, and write back everything that is still
+	 * dirty. After that, write backs are made by the threads that need
+	 * them.
+	 */
+	void stop()
+	{
+		{
+			ScopedLock guard(&lock);
+			if (!running)
+			{
+				return;
+			}
+			running = false;
+			my_pthread_cond_broadcast(&wake);
+			my_pthread_cond_broadcast(&done);
+		}
+		my_pthread_join(thread, nullptr);
+		for (const FileId &file : fileIds())
+		{
+			writeFile(file, true);
+		}
+	}
+
+	/**
+	 * Returns the file's state, or nullptr if it isn't open for writing.
+	 * lock must be held.
+	 */
+	DirtyFile *find(const FileId &file)
+	{
+		std::unordered_map<FileId, DirtyFile, FileIdHash>::iterator it =
+			files.find(file);
+		return it == files.end() ? nullptr : &it->second;
+	}
+
+	/**
+	 * Returns the ids of all the tracked files.
+	 */
+	vector<FileId> fileIds()
+	{
+		ScopedLock guard(&lock);
+		vector<FileId> ids;
+		for (std::pair<const FileId, DirtyFile> &entry : files)
+		{
+			ids.push_back(entry.first);
+		}
+		return ids;
+	}
+
+	/**
+	 * The file was opened for writing with fd, and its size on the disk
+	 * is size. Returns 0, or -errno if fd can't be duplicated.
+	 */
+	int open(const FileId &file, int fd, off_t size)
+	{
+		ScopedLock guard(&lock);
+		DirtyFile *dirtyFile = find(file);
+		if (dirtyFile != nullptr)
+		{
+			++dirtyFile->opens;
+			return 0;
+		}
+		// The file may be released before it's written back
+		int writeFd = dup(fd);
+		if (writeFd < 0)
+		{
+			return -errno;
+		}
+		files[file] = DirtyFile{writeFd, 1, size, std::set<size_t>(), 0,
+			std::map<size_t, Block*>(), false, 0, 0, 0, ++stamps};
+		tracked.store(files.size());
+		return 0;
+	}
+
+	/**
+	 * An open file that could write the file was released: write its
+	 * dirty blocks back, and forget it if it was the last one.
+	 * Returns 0, or -errno if a write back failed.
+	 */
+	int release(const FileId &file)
+	{
+		int ret = sync(file);
+		ScopedLock guard(&lock);
+		DirtyFile *dirtyFile = find(file);
+		if (dirtyFile != nullptr)
+		{
+			--dirtyFile->opens;
+			forgetIfClean(file);
+		}
+		return ret;
+	}
+
+	/**
+	 * Forget the file if it's neither open for writing nor dirty. lock
+	 * must be held.
+	 */
+	void forgetIfClean(const FileId &file)
+	{
+		DirtyFile *dirtyFile = find(file);
+		if (dirtyFile != nullptr && dirtyFile->opens == 0 &&
+		    dirtyFile->dirty.empty() && dirtyFile->evicted.empty() &&
+		    !dirtyFile->writing)
+		{
+			close(dirtyFile->fd);
+			files.erase(file);
+			tracked.store(files.size());
+		}
+	}
+
+	/**
+	 * Set size to the file's size, including the writes that weren't
+	 * written back yet, and stamp (if given) to its stamp. Returns false
+	 * if the file isn't open for writing, in which case its size on the
+	 * disk is its size.
+	 * Reading files while nothing is written doesn't lock anything.
+	 */
+	bool fileSize(const FileId &file, off_t &size,
+		      uint64_t *stamp = nullptr)
+	{
+		if (stamp != nullptr)
+		{
+			*stamp = stamps.load();
+		}
+		if (tracked.load() == 0)
+		{
+			return false;
+		}
+		ScopedLock guard(&lock);
+		DirtyFile *dirtyFile = find(file);
+		if (dirtyFile == nullptr)
+		{
+			return false;
+		}
+		size = dirtyFile->size;
+		if (stamp != nullptr)
+		{
+			*stamp = dirtyFile->stamp;
+		}
+		return true;
+	}
+
+	/**
+	 * Returns the file's stamp: take it before looking for blocks in the
+	 * cache, and only cache the blocks read from the disk for the misses
+	 * if it's still the same, since otherwise the disk might not have had
+	 * their latest data when they were read.
+	 * A file that isn't open for writing gets the last stamp given to
+	 * any file, so it changes if the file is opened and written back in
+	 * the meantime.
+	 */
+	uint64_t stamp(const FileId &file)
+	{
+		if (tracked.load() == 0)
+		{
+			return stamps.load();
+		}
+		ScopedLock guard(&lock);
+		DirtyFile *dirtyFile = find(file);
+		return dirtyFile == nullptr ? stamps.load() : dirtyFile->stamp;
+	}
+
+	/**
+	 * Set the file's size. If grow is true, the size is only changed if
+	 * it grows.
+	 */
+	void setSize(const FileId &file, off_t size, bool grow)
+	{
+		ScopedLock guard(&lock);
+		DirtyFile *dirtyFile = find(file);
+		if (dirtyFile != nullptr && (!grow || size > dirtyFile->size))
+		{
+			dirtyFile->size = size;
+		}
+	}
+
+	/**
+	 * A cached block of the file became dirty. The caller holds the
+	 * block's shard lock. Returns false if the file isn't open for
+	 * writing, so the block can't be written back.
+	 */
+	bool markDirty(const FileId &file, size_t number)
+	{
+		ScopedLock guard(&lock);
+		DirtyFile *dirtyFile = find(file);
+		if (dirtyFile == nullptr)
+		{
+			return false;
+		}
+		if (dirtyFile->dirty.empty())
+		{
+			dirtyFile->dirtiedAt = monotonicNsec();
+		}
+		dirtyFile->dirty.insert(number);
+		++dirtyBlocks;
+		countStat(STAT_DIRTIED);
+		if (expireNsec == 0 || dirtyBlocks >= maxDirty)
+		{
+			my_pthread_cond_signal(&wake);
+		}
+		return true;
+	}
+
+	/**
+	 * The cache evicted a dirty block, which is now owned here until it's
+	 * written back. Called with the block's shard lock held.
+	 */
+	void evicted(Block *block)
+	{
+		ScopedLock guard(&lock);
+		countStat(STAT_DIRTY_EVICTIONS);
+		DirtyFile *dirtyFile = find(block->file);
+		if (dirtyFile == nullptr)
+		{
+			// Can't happen: files are written back before they're
+			// forgotten
+			--dirtyBlocks;
+			delete block;
+			return;
+		}
+		dirtyFile->stamp = ++stamps;
+		if (!running)
+		{
+			writeBlocks(dirtyFile->fd, block->number,
+				    vector<struct iovec>{{block->data,
+						block->written}},
+				    dirtyFile->error);
+			--dirtyBlocks;
+			delete block;
+			my_pthread_cond_broadcast(&done);
+			return;
+		}
+		Block *&slot = dirtyFile->evicted[block->number];
+		if (slot != nullptr)
+		{
+			// Only its latest data matters
+			--dirtyBlocks;
+			delete slot;
+		}
+		slot = block;
+		my_pthread_cond_signal(&wake);
+	}
+
+	/**
+	 * Wait until the evicted blocks of the file are on the disk, so
+	 * reading it from the disk gets its latest data. Called before every
+	 * read from the disk into the cache.
+	 */
+	void waitForWrites(const FileId &file)
+	{
+		if (tracked.load() == 0)
+		{
+			return;
+		}
+		ScopedLock guard(&lock);
+		DirtyFile *dirtyFile;
+		while ((dirtyFile = find(file)) != nullptr &&
+		       (!dirtyFile->evicted.empty() || dirtyFile->writing))
+		{
+			my_pthread_cond_wait(&done, &lock);
+		}
+	}
+
+	/**
+	 * Wait while too many blocks are dirty. Called before every write.
+	 */
+	void throttle()
+	{
+		ScopedLock guard(&lock);
+		while (running && dirtyBlocks >= maxDirty)
+		{
+			my_pthread_cond_signal(&wake);
+			my_pthread_cond_wait(&done, &lock);
+		}
+	}
+
+	/**
+	 * Write all the dirty blocks of the file back to the disk, and wait
+	 * until they're written. Returns 0, or -errno if a write back of the
+	 * file failed since the last sync.
+	 */
+	int sync(const FileId &file)
+	{
+		ScopedLock guard(&lock);
+		DirtyFile *dirtyFile = find(file);
+		if (dirtyFile == nullptr)
+		{
+			return 0;
+		}
+		uint64_t request = ++dirtyFile->syncRequested;
+		my_pthread_cond_signal(&wake);
+		while ((dirtyFile = find(file)) != nullptr &&
+		       dirtyFile->syncDone < request)
+		{
+			if (!running)
+			{
+				my_pthread_mutex_unlock(&lock);
+				writeFile(file, true);
+				my_pthread_mutex_lock(&lock);
+				continue;
+			}
+			my_pthread_cond_wait(&done, &lock);
+		}
+		if (dirtyFile == nullptr)
+		{
+			return 0;
+		}
+		int error = dirtyFile->error;
+		dirtyFile->error = 0;
+		return -error;
+	}
+
+	/**
+	 * Write the given run of blocks, which starts at block first, with a
+	 * single system call. Sets error to errno if it fails and error isn't
+	 * set yet.
+	 */
+	static void writeBlocks(int fd, size_t first,
+				const vector<struct iovec> &run, int &error)
+	{
+		ssize_t wrote = pwritev(fd, run.data(), run.size(),
+					first * Block::size);
+		if (wrote < 0)
+		{
+			if (error == 0)
+			{
+				error = errno;
+			}
+			return;
+		}
+		countStat(STAT_WRITEBACKS);
+		countStat(STAT_WRITEBACK_BYTES, wrote);
+	}
+
+	/**
+	 * Write back the file's evicted blocks, and its dirty cached blocks
+	 * too if all is true, it has a sync request, or its oldest dirty
+	 * block expired. Consecutive blocks are written together.
+	 * Never called for the same file by two threads at once.
+	 */
+	void writeFile(const FileId &file, bool all)
+	{
+		std::set<size_t> cached;
+		std::map<size_t, Block*> evictedBlocks;
+		uint64_t syncRequest;
+		int fd;
+		{
+			ScopedLock guard(&lock);
+			DirtyFile *dirtyFile;
+			while ((dirtyFile = find(file)) != nullptr &&
+			       dirtyFile->writing)
+			{
+				my_pthread_cond_wait(&done, &lock);
+			}
+			if (dirtyFile == nullptr)
+			{
+				return;
+			}
+			syncRequest = dirtyFile->syncRequested;
+			if (all || syncRequest > dirtyFile->syncDone ||
+			    expired(*dirtyFile, monotonicNsec()))
+			{
+				cached.swap(dirtyFile->dirty);
+			}
+			evictedBlocks.swap(dirtyFile->evicted);
+			dirtyFile->writing = true;
+			// Cleaned blocks may be evicted before they're written
+			dirtyFile->stamp = ++stamps;
+			fd = dirtyFile->fd;
+		}
+
+		// Every run is copied out of the cache, since the shards
+		// can't stay locked while writing
+		std::set<size_t> numbers(cached);
+		for (std::pair<const size_t, Block*> &entry : evictedBlocks)
+		{
+			numbers.insert(entry.first);
+		}
+		size_t maxRun = std::max((size_t) 1,
+				std::min((size_t) WRITEBACK_MAX_RUN,
+					 WRITEBACK_MAX_RUN_BYTES / Block::size));
+		vector<char> copies(maxRun * Block::size);
+		vector<struct iovec> run;
+		size_t first = 0, cleaned = 0;
+		int error = 0;
+		for (size_t number : numbers)
+		{
+			if (!run.empty() && (number != first + run.size() ||
+			    run.back().iov_len < Block::size ||
+			    run.size() == maxRun))
+			{
+				writeBlocks(fd, first, run, error);
+				run.clear();
+			}
+			struct iovec data{nullptr, 0};
+			if (cached.count(number) != 0)
+			{
+				CacheShard &shard = shardOf(file, number);
+				ScopedLock guard(&shard.lock);
+				Block *block = shard.peek(file, number);
+				if (block != nullptr && block->dirty)
+				{
+					data.iov_base = copies.data() +
+						run.size() * Block::size;
+					data.iov_len = block->written;
+					memcpy(data.iov_base, block->data,
+					       block->written);
+					block->dirty = false;
+					++cleaned;
+				}
+			}
+			std::map<size_t, Block*>::iterator it =
+				evictedBlocks.find(number);
+			if (data.iov_base == nullptr && it != evictedBlocks.end())
+			{
+				data.iov_base = it->second->data;
+				data.iov_len = it->second->written;
+			}
+			if (data.iov_base == nullptr)
+			{
+				continue;
+			}
+			if (run.empty())
+			{
+				first = number;
+			}
+			run.push_back(data);
+		}
+		if (!run.empty())
+		{
+			writeBlocks(fd, first, run, error);
+		}
+		for (std::pair<const size_t, Block*> &entry : evictedBlocks)
+		{
+			delete entry.second;
+		}
+
+		ScopedLock guard(&lock);
+		dirtyBlocks -= cleaned + evictedBlocks.size();
+		DirtyFile *dirtyFile = find(file);
+		dirtyFile->writing = false;
+		if (dirtyFile->error == 0)
+		{
+			dirtyFile->error = error;
+		}
+		dirtyFile->syncDone = std::max(dirtyFile->syncDone,
+					       syncRequest);
+		forgetIfClean(file);
+		my_pthread_cond_broadcast(&done);
+	}
+
+	/**
+	 * Returns true if the file's oldest dirty block expired.
+	 */
+	bool expired(const DirtyFile &dirtyFile, uint64_t now) const
+	{
+		return !dirtyFile.dirty.empty() &&
+			dirtyFile.dirtiedAt + expireNsec <= now;
+	}
+
+	/**
+	 * The flusher thread's main loop: write back the files that have
+	 * evicted blocks, sync requests or expired blocks (or all the dirty
+	 * ones, when too many blocks are dirty), and sleep when there are
+	 * none.
+	 */
+	static void *run(void *arg)
+	{
+		WriteBack *self = (WriteBack*) arg;
+		ScopedLock guard(&self->lock);
+		while (self->running)
+		{
+			uint64_t now = monotonicNsec();
+			bool urgent = self->dirtyBlocks >= self->maxDirty;
+			vector<FileId> due;
+			for (std::pair<const FileId, DirtyFile> &entry :
+			     self->files)
+			{
+				DirtyFile &dirtyFile = entry.second;
+				if (!dirtyFile.evicted.empty() ||
+				    dirtyFile.syncRequested >
+				    dirtyFile.syncDone ||
+				    self->expired(dirtyFile, now) ||
+				    (urgent && !dirtyFile.dirty.empty()))
+				{
+					due.push_back(entry.first);
+				}
+			}
+			if (due.empty())
+			{
+				self->waitForWork();
+				continue;
+			}
+			my_pthread_mutex_unlock(&self->lock);
+			for (const FileId &file : due)
+			{
+				self->writeFile(file, urgent);
+			}
+			my_pthread_mutex_lock(&self->lock);
+		}
+		return nullptr;
+	}
+
+	/**
+	 * Wait until woken up or until it's time to look for expired blocks
+	 * again. lock must be held.
+	 */
+	void waitForWork()
+	{
+		uint64_t minNsec = WRITEBACK_MIN_SLEEP_MSEC * NSEC_PER_MSEC,
+			 maxNsec = WRITEBACK_MAX_SLEEP_MSEC * NSEC_PER_MSEC,
+			 sleepNsec = std::min(std::max(expireNsec / 2, minNsec),
+					      maxNsec);
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		uint64_t nsec = until.tv_nsec + sleepNsec;
+		until.tv_sec += nsec / NSEC_PER_SEC;
+		until.tv_nsec = nsec % NSEC_PER_SEC;
+		my_pthread_cond_timedwait(&wake, &lock, &until);
+	}
+};
+
+static WriteBack writeBack;	// Writes back the dirty blocks of all files
+
+/**
+ * The cache's evictDirtyBlock hook.
+ */
+void writeBackEvicted(Block *block)
+{
+	writeBack.evicted(block);
+}
+
+#endif
@@ -0,0 +1,183 @@
+/**
+ * This header is a wrapper for some of the pthread library functions
+ * which adds error handling, like the rest of the filesystem does for
+ * system calls that shouldn't fail.
+ * All functions don't return any value (void functions, except for the
+ * timed wait) and upon errors they print the system error message and exit
+ * the process.
+ */
+#ifndef _MY_PTHREAD_H
+#define _MY_PTHREAD_H
+
+#include <pthread.h>
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#define PTHREAD_SUCCESS 0
+#define PTHREAD_EXIT_FAIL 1
+
+/**
+ * Displays an error message for the given pthread function and exits.
+ */
+void pthreadError(const std::string &funcName)
+{
+	std::cerr << "System Error: \"" << funcName << "\" has failed."
+		  << std::endl;
+	exit(PTHREAD_EXIT_FAIL);
+}
+
+void my_pthread_create(pthread_t *thread, const pthread_attr_t *attr, 
+		void *(*start_routine) (void *), void *arg)
+{
+	int ret_code = PTHREAD_SUCCESS;
+	ret_code = pthread_create(thread, attr, start_routine, arg);
+	if (ret_code != PTHREAD_SUCCESS)
+	{
+		pthreadError("pthread_create");
+	}
+}
+
+void my_pthread_join(pthread_t thread, void **retval)
+{
+	int ret_code = PTHREAD_SUCCESS;
+	ret_code = pthread_join(thread, retval);
+	if (ret_code != PTHREAD_SUCCESS)
+	{
+		pthreadError("pthread_join");
+	}
+}
+
+void my_pthread_mutex_init(pthread_mutex_t *mutex,
+    const pthread_mutexattr_t *attr)
+{
+	int ret_code = PTHREAD_SUCCESS;
+	ret_code = pthread_mutex_init(mutex, attr);
+	if (ret_code != PTHREAD_SUCCESS)
+	{
+		pthreadError("pthread_mutex_init");
+	}
+}
+
+void my_pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+	int ret_code = PTHREAD_SUCCESS;
+	ret_code = pthread_mutex_destroy(mutex);
+	if (ret_code != PTHREAD_SUCCESS)
+	{
+		pthreadError("pthread_mutex_destroy");
+	}
+}
+
+void my_pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+	int ret_code = PTHREAD_SUCCESS;
+	ret_code = pthread_mutex_lock(mutex);
+	if (ret_code != PTHREAD_SUCCESS)
+	{
+		pthreadError("pthread_mutex_lock");
+	}
+}
+
+void my_pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+	int ret_code = PTHREAD_SUCCESS;
+	ret_code = pthread_mutex_unlock(mutex);
+	if (ret_code != PTHREAD_SUCCESS)
+	{
+		pthreadError("pthread_mutex_unlock");
+	}
+}
+
+void my_pthread_cond_init(pthread_cond_t *cond, 
+		const pthread_condattr_t *attr)
+{
+	int ret_code = PTHREAD_SUCCESS;
+	ret_code = pthread_cond_init(cond, attr);
+	if (ret_code != PTHREAD_SUCCESS)
+	{
+		pthreadError("pthread_cond_init");
+	}
+}
+
+void my_pthread_cond_destroy(pthread_cond_t *cond)
+{
+	int ret_code = PTHREAD_SUCCESS;
+	ret_code = pthread_cond_destroy(cond);
+	if (ret_code != PTHREAD_SUCCESS)
+	{
+		pthreadError("pthread_cond_destroy");
+	}
+}
+
+void my_pthread_cond_signal(pthread_cond_t *cond)
+{
+	int ret_code = PTHREAD_SUCCESS;
+	ret_code = pthread_cond_signal(cond);
+	if (ret_code != PTHREAD_SUCCESS)
+	{
+		pthreadError("pthread_cond_signal");
+	}
+}
+
+void my_pthread_cond_broadcast(pthread_cond_t *cond)
+{
+	int ret_code = PTHREAD_SUCCESS;
+	ret_code = pthread_cond_broadcast(cond);
+	if (ret_code != PTHREAD_SUCCESS)
+	{
+		pthreadError("pthread_cond_broadcast");
+	}
+}
+
+void my_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+	int ret_code = PTHREAD_SUCCESS;
+	ret_code = pthread_cond_wait(cond, mutex);
+	if (ret_code != PTHREAD_SUCCESS)
+	{
+		pthreadError("pthread_cond_wait");
+	}
+}
+
+/**
+ * Wait on cond until it's signalled or the absolute (CLOCK_REALTIME) time
+ * abstime passes. Returns false if the time passed.
+ */
+bool my_pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+		const struct timespec *abstime)
+{
+	int ret_code = PTHREAD_SUCCESS;
+	ret_code = pthread_cond_timedwait(cond, mutex, abstime);
+	if (ret_code != PTHREAD_SUCCESS && ret_code != ETIMEDOUT)
+	{
+		pthreadError("pthread_cond_timedwait");
+	}
+	return ret_code == PTHREAD_SUCCESS;
+}
+
+/**
+ * Locks the given mutex for as long as the object lives, so every return
+ * path of a function unlocks it.
+ */
+class ScopedLock
+{
+public:
+	pthread_mutex_t *mutex;
+
+	ScopedLock(pthread_mutex_t *m) : mutex(m)
+	{
+		my_pthread_mutex_lock(mutex);
+	}
+
+	~ScopedLock()
+	{
+		my_pthread_mutex_unlock(mutex);
+	}
+
+	ScopedLock(const ScopedLock &other) = delete;
+	ScopedLock& operator= (const ScopedLock &other) = delete;
+};
+
+#endif
@@ -0,0 +1,637 @@
+/**
+ * Micro benchmarks for the block cache in Cache.h. The cache functions are
+ * called directly, without mounting anything, so only the cost of the
+ * caching logic itself is measured.
+ *
+ * Usage: CacheBench
+ */
+#define FUSE_USE_VERSION 26
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+#include <random>
+#include <malloc.h>
+
+#include "../Cache.h"
+
+// The block size doesn't matter for the caching logic, so keep it small to
+// let the big caches fit in memory.
+#define BENCH_BLOCK_SIZE 64
+#define BENCH_FILES 64
+#define BENCH_LOOKUPS 1000000
+#define BENCH_HOT_BLOCKS 1000	// Few enough for the CPU caches
+#define BENCH_F_NEW 0.3
+#define BENCH_F_OLD 0.3
+#define BENCH_MAX_THREADS 16
+#define BENCH_THREAD_BLOCKS 4096
+#define BENCH_POLICY_BLOCKS 1000
+#define BENCH_HOT_SHARE 80	// Percents of the reads that go to the hot set
+#define BENCH_SCAN_HOT_SHARE 50	// ... while a scan is running
+#define BENCH_SLIDE_READS 100	// Reads per block the working set slides
+#define BENCH_CACHE_BYTES (64 * 1024 * 1024)	// For comparing block sizes
+#define BENCH_MIN_BLOCK_SIZE 4096
+#define BENCH_MAX_BLOCK_SIZE (2 * 1024 * 1024)
+#define BENCH_READ_SIZE (128 * 1024)	// What fuse asks for at most
+#define BENCH_PAGE_SIZE 4096	// Reads are aligned to that
+#define BENCH_RANGE_READS 100000
+#define BENCH_PACK_BLOCK_SIZE 4096
+#define BENCH_PACK_BLOCKS 4096
+
+using std::chrono::steady_clock;
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+
+/* ========== Allocation counting ========== */
+
+// Number of heap allocations made by the process so far. glibc lets a
+// program replace malloc, so the replacements below count every call and
+// forward it to the real allocator. This also covers operator new.
+static size_t allocations = 0;
+
+extern "C"
+{
+void *__libc_malloc(size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size) noexcept
+{
+	++allocations;
+	return __libc_malloc(size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept
+{
+	++allocations;
+	return __libc_memalign(alignment, size);
+}
+}
+
+/* ========== Benchmarks ========== */
+
+/**
+ * Returns the (fake) id of the i'th benchmark file.
+ */
+static FileId benchFile(size_t i)
+{
+	return FileId{0, (ino_t) i + 1};
+}
+
+/**
+ * Empty the cache and set its parameters for a cache of the given size.
+ */
+static void resetCache(size_t blocks)
+{
+	maxSize = blocks;
+	newIdx = maxSize * BENCH_F_NEW;
+	oldIdx = maxSize * (1 - BENCH_F_OLD);
+	initCache();
+}
+
+/**
+ * Look a block up the way caching_read does: lock its shard, get it, and
+ * cache it if it's missing (and admitted). Returns true on a hit.
+ */
+static bool readBlock(const FileId &file, size_t num)
+{
+	CacheShard &shard = shardOf(file, num);
+	ScopedLock lock(&shard.lock);
+	if (shard.get(file, num) != nullptr)
+	{
+		return true;
+	}
+	Block *block = new Block(file, num);
+	if (shard.admit(block) == nullptr)
+	{
+		delete block;
+	}
+	return false;
+}
+
+/**
+ * Look up random blocks of cached, the first 'among' of them, and return
+ * the average time of a lookup. hits is set to the number of hits.
+ */
+static double timeLookups(const vector<BlockKey> &cached, size_t among,
+			  size_t &hits)
+{
+	std::mt19937 rng(among);
+	vector<size_t> order(BENCH_LOOKUPS);
+	for (size_t &i : order)
+	{
+		i = rng() % among;
+	}
+
+	hits = 0;
+	steady_clock::time_point start = steady_clock::now();
+	for (size_t i : order)
+	{
+		hits += readBlock(cached[i].file, cached[i].number);
+	}
+	return (double) duration_cast<nanoseconds>(steady_clock::now() -
+						   start).count() /
+		BENCH_LOOKUPS;
+}
+
+/**
+ * Fill a cache of the given size and measure the average time of a hit,
+ * for hits spread uniformly over all the cached blocks, and over a few of
+ * them. Blocks are hashed to shards unevenly, so every shard is filled up
+ * to its own capacity, and all the lookups hit.
+ * The hit path is O(1), but its memory isn't: the index buckets and the
+ * blocks a lookup touches stop fitting in the CPU caches as the cache
+ * grows, so hits over all the blocks get slower while hits over a few of
+ * them don't.
+ */
+static void benchHitLatency(size_t blocks)
+{
+	resetCache(blocks);
+	vector<BlockKey> cached;
+	for (size_t i = 0; cached.size() < blocks; ++i)
+	{
+		FileId file = benchFile(i % BENCH_FILES);
+		size_t num = i / BENCH_FILES;
+		CacheShard &shard = shardOf(file, num);
+		if (shard.size() < shard.maxSize)
+		{
+			readBlock(file, num);
+			cached.push_back(BlockKey{file, num});
+		}
+	}
+
+	size_t hot = std::min(blocks, (size_t) BENCH_HOT_BLOCKS), hits, hotHits;
+	double ns = timeLookups(cached, blocks, hits);
+	double hotNs = timeLookups(cached, hot, hotHits);
+	printf("%10zu blocks: %8.1f ns/hit, %8.1f ns/hit of %zu of them "
+	       "(%zu/%d hits)\n", blocks, ns, hotNs, hot, hits + hotHits,
+	       2 * BENCH_LOOKUPS);
+}
+
+/**
+ * Fill a cache of the given size, give its blocks assorted refCounts, and
+ * then measure the average time of a miss (eviction + insertion) while
+ * scanning blocks that were never cached.
+ */
+static void benchMissLatency(size_t blocks)
+{
+	vector<FileId> files;
+	for (size_t i = 0; i < BENCH_FILES; ++i)
+	{
+		files.push_back(benchFile(i));
+	}
+	resetCache(blocks);
+	for (size_t i = 0; i < blocks; ++i)
+	{
+		readBlock(files[i % BENCH_FILES], i / BENCH_FILES);
+	}
+	std::mt19937 rng(blocks);
+	for (size_t i = 0; i < blocks; ++i)
+	{
+		size_t j = rng() % blocks;
+		readBlock(files[j % BENCH_FILES], j / BENCH_FILES);
+	}
+
+	FileId scanFile = benchFile(BENCH_FILES);
+	steady_clock::time_point start = steady_clock::now();
+	for (size_t i = 0; i < BENCH_LOOKUPS; ++i)
+	{
+		readBlock(scanFile, i);
+	}
+	double ns = duration_cast<nanoseconds>(steady_clock::now() - start)
+		.count();
+
+	printf("%10zu blocks: %8.1f ns/miss\n", blocks, ns / BENCH_LOOKUPS);
+}
+
+/**
+ * Count the heap allocations made by hits and by misses in a full cache of
+ * the given size. A hit should only relink the block, so it shouldn't
+ * allocate at all.
+ */
+static void benchAllocations(size_t blocks)
+{
+	FileId file = benchFile(0);
+	// Leave room in every shard, so all the lookups below really hit
+	resetCache(2 * blocks);
+	for (size_t i = 0; i < blocks; ++i)
+	{
+		readBlock(file, i);
+	}
+
+	std::mt19937 rng(blocks);
+	size_t before = allocations;
+	for (size_t i = 0; i < BENCH_LOOKUPS; ++i)
+	{
+		readBlock(file, rng() % blocks);
+	}
+	size_t hitAllocs = allocations - before;
+
+	before = allocations;
+	for (size_t i = blocks; i < blocks + BENCH_LOOKUPS; ++i)
+	{
+		readBlock(file, i);
+	}
+	size_t missAllocs = allocations - before;
+
+	printf("%10zu blocks: %.3f allocations/hit, %.3f allocations/miss\n",
+			blocks, (double) hitAllocs / BENCH_LOOKUPS,
+			(double) missAllocs / BENCH_LOOKUPS);
+}
+
+/**
+ * The body of a reader thread: hit random blocks of its own file.
+ */
+static void *readerThread(void *arg)
+{
+	FileId file = benchFile((size_t) arg);
+	std::mt19937 rng((size_t) arg);
+	for (size_t i = 0; i < BENCH_LOOKUPS; ++i)
+	{
+		readBlock(file, rng() % BENCH_THREAD_BLOCKS);
+	}
+	return nullptr;
+}
+
+/**
+ * Measure the total hit throughput of the given number of threads, each
+ * reading its own (cached) file.
+ */
+static void benchParallelHits(size_t threads)
+{
+	resetCache(BENCH_MAX_THREADS * BENCH_THREAD_BLOCKS);
+	for (size_t t = 0; t < threads; ++t)
+	{
+		for (size_t i = 0; i < BENCH_THREAD_BLOCKS; ++i)
+		{
+			readBlock(benchFile(t), i);
+		}
+	}
+
+	vector<pthread_t> tids(threads);
+	steady_clock::time_point start = steady_clock::now();
+	for (size_t t = 0; t < threads; ++t)
+	{
+		my_pthread_create(&tids[t], nullptr, readerThread, (void*) t);
+	}
+	for (size_t t = 0; t < threads; ++t)
+	{
+		my_pthread_join(tids[t], nullptr);
+	}
+	double sec = duration_cast<nanoseconds>(steady_clock::now() - start)
+		.count() / 1e9;
+
+	printf("%10zu threads: %8.2f M hits/s\n", threads, 
+			threads * BENCH_LOOKUPS / sec / 1e6);
+}
+
+/**
+ * Read blocks the way the given workload does: a hot set (a bit smaller
+ * than the cache) mixed with a long scan, or a working set of the same
+ * size that keeps sliding forward, which favors recency over frequency.
+ * Returns the hit ratio.
+ */
+static double runWorkload(bool sliding)
+{
+	FileId hotFile = benchFile(0), scanFile = benchFile(1);
+	size_t setBlocks = BENCH_POLICY_BLOCKS * 3 / 4, scanned = 0, hits = 0;
+	std::mt19937 rng(BENCH_POLICY_BLOCKS);
+	for (size_t i = 0; i < BENCH_LOOKUPS; ++i)
+	{
+		if (sliding)
+		{
+			hits += readBlock(hotFile, i / BENCH_SLIDE_READS +
+					  rng() % setBlocks);
+		}
+		else if (rng() % 100 < BENCH_HOT_SHARE)
+		{
+			hits += readBlock(hotFile, rng() % setBlocks);
+		}
+		else
+		{
+			hits += readBlock(scanFile, scanned++);
+		}
+	}
+	return (double) hits / BENCH_LOOKUPS;
+}
+
+/**
+ * Measure the hit ratio of every policy on a workload that mixes a hot set
+ * of random blocks (a bit smaller than the cache) with a long sequential
+ * scan, which a pure recency policy lets flush the hot set.
+ */
+static void benchPolicies()
+{
+	const char *policies[] = {POLICY_FBR, POLICY_ADAPTIVE_FBR, POLICY_LRU,
+				  POLICY_LFU, POLICY_2Q, POLICY_ARC,
+				  POLICY_CLOCK_PRO};
+	for (const char *policy : policies)
+	{
+		policyName = policy;
+		resetCache(BENCH_POLICY_BLOCKS);
+		printf("%10s: %.3f hit ratio\n", policy, runWorkload(false));
+	}
+	policyName = DEF_POLICY;
+}
+
+/**
+ * Compare FBR at a few fixed partitions to adaptive FBR (starting at the
+ * benchmark's partition) on two workloads that want different ones.
+ */
+static void benchAdaptiveFbr()
+{
+	double partitions[][2] = {{0.1, 0.1}, {0.3, 0.3}, {0.6, 0.3},
+				  {0.8, 0.1}};
+	printf("%15s", "fbr/fOld/fNew:");
+	for (double *partition : partitions)
+	{
+		printf("    %.1f/%.1f", partition[0], partition[1]);
+	}
+	printf("  adaptive\n");
+	for (int sliding = 0; sliding < 2; ++sliding)
+	{
+		printf("%14s:", sliding ? "sliding set" : "hot set + scan");
+		policyName = POLICY_FBR;
+		for (double *partition : partitions)
+		{
+			maxSize = BENCH_POLICY_BLOCKS;
+			oldIdx = maxSize * (1 - partition[0]);
+			newIdx = maxSize * partition[1];
+			initCache();
+			printf(" %10.3f", runWorkload(sliding));
+		}
+		policyName = POLICY_ADAPTIVE_FBR;
+		resetCache(BENCH_POLICY_BLOCKS);
+		printf(" %9.3f\n", runWorkload(sliding));
+	}
+	policyName = DEF_POLICY;
+}
+
+/**
+ * Measure how much of the hot set survives a scan, with and without the
+ * admission filter: a hot set of random blocks (a bit smaller than the
+ * cache) is read until it's cached, and then keeps being read while a
+ * long sequential scan of a cold file runs. Prints the hit ratio of the
+ * hot set's reads during the scan.
+ */
+static void benchAdmission()
+{
+	const char *policies[] = {POLICY_FBR, POLICY_LRU, POLICY_LFU};
+	FileId hotFile = benchFile(0), scanFile = benchFile(1);
+	size_t hotBlocks = BENCH_POLICY_BLOCKS * 3 / 4;
+	for (const char *policy : policies)
+	{
+		policyName = policy;
+		printf("%10s:", policy);
+		for (int filter = 0; filter < 2; ++filter)
+		{
+			admissionFilter = filter != 0;
+			resetCache(BENCH_POLICY_BLOCKS);
+			std::mt19937 rng(BENCH_POLICY_BLOCKS);
+			for (size_t i = 0; i < BENCH_LOOKUPS / 10; ++i)
+			{
+				readBlock(hotFile, rng() % hotBlocks);
+			}
+			size_t hotHits = 0, hotReads = 0, scanned = 0;
+			for (size_t i = 0; i < BENCH_LOOKUPS; ++i)
+			{
+				if (rng() % 100 < BENCH_SCAN_HOT_SHARE)
+				{
+					hotHits += readBlock(hotFile,
+							rng() % hotBlocks);
+					++hotReads;
+				}
+				else
+				{
+					readBlock(scanFile, scanned++);
+				}
+			}
+			printf(" %.3f hot hit ratio%s", 
+			       (double) hotHits / hotReads,
+			       filter ? " with " ADMISSION_TINYLFU "\n" : ",");
+		}
+	}
+	admissionFilter = false;
+	policyName = DEF_POLICY;
+}
+
+/**
+ * Returns the bytes the heap has handed out, including big mmap()ed chunks.
+ */
+static size_t heapBytes()
+{
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+}
+
+/**
+ * Copy length bytes at offset of a cached file into buf, the way
+ * caching_read does on hits: look every block the range covers up under
+ * its shard's lock and copy its part of the range.
+ */
+static void readRange(const FileId &file, size_t offset, size_t length,
+		      char *buf)
+{
+	size_t copied = 0;
+	while (copied < length)
+	{
+		size_t num = (offset + copied) / Block::size,
+		       blockOff = (offset + copied) % Block::size,
+		       toCopy = std::min(Block::size - blockOff,
+					 length - copied);
+		CacheShard &shard = shardOf(file, num);
+		ScopedLock lock(&shard.lock);
+		Block *block = shard.get(file, num);
+		if (block != nullptr)
+		{
+			memcpy(buf + copied, block->data + blockOff, toCopy);
+		}
+		copied += toCopy;
+	}
+}
+
+/**
+ * Cache a file of BENCH_CACHE_BYTES in blocks of every size from 4KB to
+ * 2MB (with the block arena, as when mounted), and measure the heap the
+ * cache's metadata takes (blocks, index and policy) and the throughput of
+ * page aligned BENCH_READ_SIZE reads at random offsets of the file.
+ */
+static void benchBlockSizes()
+{
+	FileId file = benchFile(0);
+	vector<char> buf(BENCH_READ_SIZE);
+	for (size_t size = BENCH_MIN_BLOCK_SIZE; size <= BENCH_MAX_BLOCK_SIZE;
+	     size *= 2)
+	{
+		Block::size = size;
+		size_t blocks = BENCH_CACHE_BYTES / size;
+		blockArena.init(blocks, size, false);
+		resetCache(blocks);
+		size_t before = heapBytes();
+		for (size_t i = 0; i < blocks; ++i)
+		{
+			CacheShard &shard = shardOf(file, i);
+			ScopedLock lock(&shard.lock);
+			Block *block = new Block(file, i);
+			memset(block->data, (int) i, size);
+			block->written = size;
+			if (shard.admit(block) == nullptr)
+			{
+				delete block;
+			}
+		}
+		size_t metadata = heapBytes() - before;
+
+		std::mt19937 rng(size);
+		size_t pages = (BENCH_CACHE_BYTES - BENCH_READ_SIZE) /
+			BENCH_PAGE_SIZE;
+		steady_clock::time_point start = steady_clock::now();
+		for (size_t i = 0; i < BENCH_RANGE_READS; ++i)
+		{
+			readRange(file, rng() % pages * BENCH_PAGE_SIZE,
+				  BENCH_READ_SIZE, buf.data());
+		}
+		double sec = duration_cast<nanoseconds>(steady_clock::now() -
+			start).count() / 1e9;
+
+		printf("%8zuKB: %6zu blocks, %8zu bytes of metadata "
+		       "(%4zu/block), %6.2f GB/s\n", size / 1024, blocks,
+		       metadata, metadata / blocks, (double) BENCH_RANGE_READS *
+		       BENCH_READ_SIZE / sec / 1e9);
+		destroyCache();
+		blockArena.destroy();
+	}
+	Block::size = BENCH_BLOCK_SIZE;
+}
+
+/**
+ * Fill data with one of the kinds of content the compression benchmark
+ * compresses: log lines, JSON records, or random bytes.
+ */
+static void benchContent(int kind, vector<char> &data)
+{
+	std::mt19937 rng(kind);
+	string text;
+	while (text.size() < data.size())
+	{
+		char line[STATS_LINE_MAX];
+		unsigned long long id = rng() % 100000000;
+		if (kind == 0)
+		{
+			snprintf(line, sizeof(line), "2024-05-%02llu 12:%02llu:%02llu"
+				 " INFO request %llu served in %llu ms\n",
+				 id % 28 + 1, id % 60, id / 60 % 60, id,
+				 id % 997);
+		}
+		else
+		{
+			snprintf(line, sizeof(line), "{\"id\": %llu, \"name\": "
+				 "\"user%llu\", \"active\": %s, \"score\": "
+				 "%llu.%02llu},\n", id, id % 5000,
+				 id % 3 ? "true" : "false", id % 1000, id % 100);
+		}
+		text += line;
+	}
+	for (size_t i = 0; i < data.size(); ++i)
+	{
+		data[i] = kind == 2 ? (char) rng() : text[i];
+	}
+}
+
+/**
+ * Measure the ratio and speed of the codec of -o compress (Compress.h) on
+ * 4KB blocks of assorted content.
+ */
+static void benchCompression()
+{
+	const char *kinds[] = {"log lines", "JSON", "random"};
+	size_t blockSize = BENCH_PACK_BLOCK_SIZE, capacity = blockSize * 2;
+	vector<char> data(BENCH_PACK_BLOCKS * blockSize),
+		packed(BENCH_PACK_BLOCKS * capacity), out(blockSize);
+	vector<size_t> sizes(BENCH_PACK_BLOCKS);
+	for (int kind = 0; kind < 3; ++kind)
+	{
+		benchContent(kind, data);
+		size_t total = 0;
+		steady_clock::time_point start = steady_clock::now();
+		for (size_t i = 0; i < BENCH_PACK_BLOCKS; ++i)
+		{
+			sizes[i] = lzCompress(data.data() + i * blockSize,
+					      blockSize,
+					      packed.data() + i * capacity,
+					      capacity);
+			total += sizes[i];
+		}
+		double packNs = duration_cast<nanoseconds>(
+			steady_clock::now() - start).count();
+		size_t bad = 0;
+		start = steady_clock::now();
+		for (size_t i = 0; i < BENCH_PACK_BLOCKS; ++i)
+		{
+			lzDecompress(packed.data() + i * capacity, sizes[i],
+				     out.data(), blockSize);
+			bad += memcmp(out.data(), data.data() + i * blockSize,
+				      blockSize) != 0;
+		}
+		double unpackNs = duration_cast<nanoseconds>(
+			steady_clock::now() - start).count();
+		printf("%10s: %5.2fx, %6.2f us/pack, %6.2f us/unpack%s\n",
+		       kinds[kind], (double) data.size() / total,
+		       packNs / BENCH_PACK_BLOCKS / 1e3,
+		       unpackNs / BENCH_PACK_BLOCKS / 1e3,
+		       bad != 0 ? " (MISMATCH)" : "");
+	}
+}
+
+int main()
+{
+	Block::size = BENCH_BLOCK_SIZE;
+
+	printf("== Hit latency by cache size ==\n");
+	for (size_t blocks = 100; blocks <= 1000000; blocks *= 10)
+	{
+		benchHitLatency(blocks);
+	}
+
+	printf("== Miss latency (scan) by cache size ==\n");
+	for (size_t blocks = 100; blocks <= 1000000; blocks *= 10)
+	{
+		benchMissLatency(blocks);
+	}
+
+	printf("== Heap allocations per cache operation ==\n");
+	benchAllocations(10000);
+	// The buffers are only freed when the cache is cleared, so the arena
+	// must be able to hold two caches' worth
+	blockArena.init(4 * 10000, BENCH_BLOCK_SIZE, false);
+	printf("== ... with the block arena ==\n");
+	benchAllocations(10000);
+	destroyCache();
+	blockArena.destroy();
+
+	printf("== Parallel hit throughput (%zu shards) ==\n", 
+			(size_t) CACHE_SHARDS);
+	for (size_t threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2)
+	{
+		benchParallelHits(threads);
+	}
+
+	printf("== Hit ratio by policy (hot set + scan) ==\n");
+	benchPolicies();
+
+	printf("== Hit ratio of FBR partitions and adaptive FBR ==\n");
+	benchAdaptiveFbr();
+
+	printf("== Hot set hit ratio during a scan, by admission ==\n");
+	benchAdmission();
+
+	printf("== Metadata and read throughput by block size (%dMB cached) "
+	       "==\n", BENCH_CACHE_BYTES / (1024 * 1024));
+	benchBlockSizes();
+
+	printf("== Compression of 4KB blocks (-o compress) ==\n");
+	benchCompression();
+
+	destroyCache();
+	return 0;
+}
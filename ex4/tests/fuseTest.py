@@ -131,6 +131,88 @@ class TestFuse(unittest.TestCase):
         posix.close(secondFileFd)
         self.assertTrue(open("mount/folder2/file").read()== open("src/folder2/file").read())
 
+    def readAll(self, path):
+        with open(path, "rb") as f:
+            return f.read()
+
+    def cacheStat(self, name):
+        for line in open("mount/.cachestats").read().splitlines():
+            if line.split()[0] == name:
+                return float(line.split()[1])
+        self.fail("no %s in /.cachestats"%(name))
+
+    def test_partialBlockWrite(self):
+        data = self.readAll("src/file1")
+        written = os.urandom(100)
+        fd = posix.open("mount/file1", posix.O_RDWR)
+        posix.lseek(fd, 5000, 0)
+        posix.write(fd, written)
+        posix.lseek(fd, 4900, 0)
+        self.assertEqual(posix.read(fd, 300), data[4900:5000] + written + data[5100:5200])
+        posix.close(fd)
+        data = data[:5000] + written + data[5100:]
+        self.assertEqual(self.readAll("mount/file1"), data)
+        self.assertEqual(self.readAll("src/file1"), data)
+
+    def test_extendingWrite(self):
+        data = self.readAll("src/file1")
+        written = os.urandom(3000)
+        fd = posix.open("mount/file1", posix.O_RDWR)
+        posix.lseek(fd, 12000, 0)
+        posix.write(fd, written)
+        self.assertEqual(os.stat("mount/file1").st_size, 15000)
+        self.assertEqual(posix.fstat(fd).st_size, 15000)
+        posix.close(fd)
+        data = data + b"\0" * 2000 + written
+        self.assertEqual(os.stat("mount/file1").st_size, 15000)
+        self.assertEqual(self.readAll("mount/file1"), data)
+        self.assertEqual(self.readAll("src/file1"), data)
+
+    def test_truncateDownAndUp(self):
+        data = self.readAll("src/file1")
+        self.readAll("mount/file1")
+        os.truncate("mount/file1", 3000)
+        self.assertEqual(os.stat("mount/file1").st_size, 3000)
+        self.assertEqual(self.readAll("mount/file1"), data[:3000])
+        fd = posix.open("mount/file1", posix.O_RDWR)
+        posix.ftruncate(fd, 9000)
+        self.assertEqual(posix.fstat(fd).st_size, 9000)
+        posix.close(fd)
+        data = data[:3000] + b"\0" * 6000
+        self.assertEqual(os.stat("mount/file1").st_size, 9000)
+        self.assertEqual(self.readAll("mount/file1"), data)
+        self.assertEqual(self.readAll("src/file1"), data)
+
+    def test_fsyncReachesDisk(self):
+        data = bytearray(self.readAll("src/file2"))
+        fd = posix.open("mount/file2", posix.O_RDWR)
+        for i in range(100):
+            position = random.randint(0, 10000)
+            written = os.urandom(random.randint(1, 1000))
+            posix.lseek(fd, position, 0)
+            posix.write(fd, written)
+            data[position:position + len(written)] = written
+        posix.fsync(fd)
+        # Before the release, so only the fsync wrote them back
+        self.assertEqual(self.readAll("src/file2"), bytes(data))
+        posix.close(fd)
+        self.assertEqual(self.readAll("mount/file2"), bytes(data))
+
+    def test_dirtyEvictions(self):
+        # 8 blocks that may all be dirty and stay so, so writing 64 blocks
+        # evicts dirty blocks
+        os.system("fusermount -u %s/mount"%(os.getcwd()))
+        os.system("%s %s/src %s/mount 8 0.30 0.30 -o dirty_max=8 -o dirty_expire=60000"%(TestFuse.fuserPath, os.getcwd(), os.getcwd()))
+        blockSize = os.stat("src").st_blksize
+        data = os.urandom(64 * blockSize + 1000)
+        fd = posix.open("mount/file3", posix.O_WRONLY | posix.O_CREAT, 0o644)
+        for position in range(0, len(data), 3000):
+            posix.write(fd, data[position:position + 3000])
+        posix.close(fd)
+        self.assertGreater(self.cacheStat("dirty_evictions"), 0)
+        self.assertEqual(self.readAll("mount/file3"), data)
+        self.assertEqual(self.readAll("src/file3"), data)
+
   
 def getFuserPath():
     parser = argparse.ArgumentParser()